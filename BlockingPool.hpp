@@ -0,0 +1,183 @@
+/*
+Copyright 2015 Shoestring Research, LLC.  All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef poolqueue_BlockingPool_hpp
+#define poolqueue_BlockingPool_hpp
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iterator>
+#include <list>
+#include <mutex>
+#include <thread>
+
+#include "Promise.hpp"
+
+namespace poolqueue {
+
+   // Thread pool for blocking jobs.
+   //
+   // A ThreadPool is sized for computation, so a job that blocks in
+   // a system call idles a core and holds up the jobs behind it.
+   // This pool is intended for such jobs instead. It starts a new
+   // thread whenever a job is posted and no thread is idle (up to a
+   // maximum), and a thread exits after it has been idle for the
+   // keep-alive period, so the thread count follows the number of
+   // concurrently blocked jobs.
+   //
+   // ThreadPoolT::postBlocking() runs a job on the shared instance
+   // and delivers its result on the compute pool.
+   class BlockingPool {
+   public:
+      // Construct a pool. No threads are started until jobs are
+      // posted.
+      // @maxThreads Maximum number of threads.
+      // @keepAlive  Idle time before a thread exits.
+      explicit BlockingPool(unsigned int maxThreads = 256,
+                            std::chrono::steady_clock::duration keepAlive = std::chrono::seconds(10))
+         : maxThreads_(std::max(maxThreads, 1U))
+         , keepAlive_(keepAlive) {
+      }
+
+      BlockingPool(const BlockingPool&) = delete;
+      BlockingPool& operator=(const BlockingPool&) = delete;
+
+      // Destructor.
+      //
+      // Queued jobs are run before the destructor returns.
+      ~BlockingPool() {
+         std::unique_lock<std::mutex> lock(mutex_);
+         stopping_ = true;
+         condition_.notify_all();
+         exited_.wait(lock, [this]() { return threads_.empty(); });
+
+         for (auto& t : finished_)
+            t.join();
+      }
+
+      // Get the shared instance.
+      static BlockingPool& instance() {
+         static BlockingPool pool;
+         return pool;
+      }
+
+      // Post (enqueue) a job.
+      // @f Function or functor to run.
+      //
+      // This is the same as ThreadPoolT::post() except that the job
+      // runs on a BlockingPool thread.
+      //
+      // @return Promise that fulfils or rejects with the outcome
+      //         of the function argument.
+      template<typename F>
+      Promise post(F&& f) {
+         typedef typename detail::CallableTraits<F>::ArgumentType Argument;
+         typedef typename detail::CallableTraits<F>::ResultType Result;
+         static_assert(std::is_same<Argument, void>::value,
+                       "function must take no argument");
+         static_assert(!std::is_same<Result, void>::value,
+                       "function must return a value");
+
+         Promise p(std::forward<F>(f));
+         std::list<std::thread> finished;
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            queue_.push_back(p);
+
+            // Jobs beyond the idle threads need a new thread.
+            if (queue_.size() > idle_ && threads_.size() < maxThreads_) {
+               try {
+                  threads_.emplace_back();
+                  auto self = std::prev(threads_.end());
+                  *self = std::thread(&BlockingPool::run, this, self);
+               }
+               catch (...) {
+                  threads_.pop_back();
+                  if (threads_.empty()) {
+                     queue_.pop_back();
+                     throw;
+                  }
+               }
+            }
+            else {
+               condition_.notify_one();
+            }
+            finished.swap(finished_);
+         }
+
+         for (auto& t : finished)
+            t.join();
+         return p;
+      }
+
+      // Get the number of threads.
+      //
+      // @return Number of threads currently running.
+      unsigned int getThreadCount() {
+         std::lock_guard<std::mutex> lock(mutex_);
+         return static_cast<unsigned int>(threads_.size());
+      }
+
+   private:
+      const size_t maxThreads_;
+      const std::chrono::steady_clock::duration keepAlive_;
+
+      std::mutex mutex_;
+      std::condition_variable condition_;
+      std::condition_variable exited_;
+      std::deque<Promise> queue_;
+      size_t idle_ = 0;
+      bool stopping_ = false;
+
+      // Threads that have exited are moved to finished_ to be
+      // joined by a later post() or the destructor.
+      std::list<std::thread> threads_;
+      std::list<std::thread> finished_;
+
+      void run(std::list<std::thread>::iterator self) {
+         std::unique_lock<std::mutex> lock(mutex_);
+         while (true) {
+            if (!queue_.empty()) {
+               Promise p = std::move(queue_.front());
+               queue_.pop_front();
+
+               lock.unlock();
+               p.settle();
+               lock.lock();
+               continue;
+            }
+
+            if (stopping_)
+               break;
+
+            ++idle_;
+            const bool woken = condition_.wait_for(lock, keepAlive_, [this]() {
+                  return !queue_.empty() || stopping_;
+               });
+            --idle_;
+            if (!woken)
+               break;
+         }
+
+         finished_.splice(finished_.end(), threads_, self);
+         exited_.notify_all();
+      }
+   };
+
+} // namespace poolqueue
+
+#endif // poolqueue_BlockingPool_hpp
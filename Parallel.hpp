@@ -0,0 +1,100 @@
+/*
+Copyright 2015 Shoestring Research, LLC.  All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef poolqueue_Parallel_hpp
+#define poolqueue_Parallel_hpp
+
+#include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include "Promise.hpp"
+#include "Parallel_detail.hpp"
+
+namespace poolqueue {
+
+   // Parallel loop on a ThreadPool.
+   // @pool  ThreadPool (any ThreadPoolT instantiation).
+   // @bgn   First index.
+   // @end   One past the last index.
+   // @body  Function or functor with signature void body(size_t i).
+   // @grain Optional minimum number of indices per chunk.
+   //
+   // This function calls body(i) for each index in [bgn, end) on
+   // pool threads. The range is divided into contiguous chunks that
+   // are claimed dynamically by one job per pool thread, starting
+   // large and shrinking as the range is consumed, so the caller
+   // does not need to choose a chunk size and threads that finish
+   // early take over the remaining work. Only one Promise is
+   // allocated per pool thread, not per chunk.
+   //
+   // If body throws, no new chunks are started and the returned
+   // Promise rejects with the first exception.
+   //
+   // @return Promise that fulfils (with an empty value) when all
+   //         calls complete.
+   template<typename TP, typename F>
+   Promise parallelFor(TP& pool, size_t bgn, size_t end, const F& body, size_t grain = 1) {
+      if (bgn >= end)
+         return Promise().settle();
+
+      grain = std::max<size_t>(grain, 1);
+      const size_t nChunks = (end - bgn + grain - 1)/grain;
+      const size_t nHelpers = std::max<size_t>(std::min<size_t>(pool.getThreadCount(), nChunks), 1);
+      auto context = std::make_shared<detail::ParallelFor<F> >(bgn, end, grain, nHelpers, body);
+      detail::postHelpers(pool, nHelpers, context);
+      return context->promise_;
+   }
+
+   // Parallel reduction on a ThreadPool.
+   // @pool     ThreadPool (any ThreadPoolT instantiation).
+   // @bgn      First index.
+   // @end      One past the last index.
+   // @identity Identity value of combine, e.g. 0 for addition.
+   // @body     Function or functor with signature T body(size_t i).
+   // @combine  Function or functor with signature T combine(T, T).
+   //           It must be associative but need not be commutative.
+   // @grain    Optional minimum number of indices per chunk.
+   //
+   // This function computes
+   //
+   //   combine(...combine(combine(identity, body(bgn)), body(bgn + 1))..., body(end - 1))
+   //
+   // with the calls to body distributed across pool threads as in
+   // parallelFor().
+   //
+   // @return Promise that fulfils with the result value of type T,
+   //         or rejects with the first exception thrown by body or
+   //         combine.
+   template<typename TP, typename T, typename F, typename C>
+   Promise parallelReduce(TP& pool, size_t bgn, size_t end, const T& identity, const F& body, const C& combine, size_t grain = 1) {
+      if (bgn >= end)
+         return Promise().settle(identity);
+
+      grain = std::max<size_t>(grain, 1);
+      const size_t nChunks = (end - bgn + grain - 1)/grain;
+      const size_t nHelpers = std::max<size_t>(std::min<size_t>(pool.getThreadCount(), nChunks), 1);
+      auto context = std::make_shared<detail::ParallelReduce<T, F, C> >(bgn, end, grain, nHelpers, identity, body, combine);
+      detail::postHelpers(pool, nHelpers, context);
+      return context->promise_;
+   }
+
+} // namespace poolqueue
+
+#endif // poolqueue_Parallel_hpp
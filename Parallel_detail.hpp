@@ -0,0 +1,188 @@
+/*
+Copyright 2015 Shoestring Research, LLC.  All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+namespace poolqueue {
+   namespace detail {
+
+      // Shared state for a parallel loop. Each helper job claims
+      // chunks from the front of the remaining range until it is
+      // exhausted. Chunk size is a fixed fraction of what remains
+      // (guided self-scheduling), so early chunks are large to
+      // amortize overhead and late chunks are small to balance load
+      // among helpers that finish at different times.
+      struct ParallelRange {
+         const size_t end_;
+         const size_t grain_;
+         const size_t divisor_;
+         std::atomic<size_t> next_;
+         std::atomic<size_t> helpers_;
+         std::atomic<bool> failed_;
+
+         std::mutex mutex_;
+         std::exception_ptr exception_;
+         Promise promise_;
+
+         ParallelRange(size_t bgn, size_t end, size_t grain, size_t nHelpers)
+            : end_(end)
+            , grain_(grain)
+            , divisor_(2*nHelpers)
+            , next_(bgn)
+            , helpers_(nHelpers)
+            , failed_(false) {
+         }
+
+         // Claim the next chunk [bgn, end). Returns false when
+         // there is no more work.
+         bool claim(size_t& bgn, size_t& end) {
+            size_t next = next_.load(std::memory_order_relaxed);
+            do {
+               if (next >= end_ || failed_.load(std::memory_order_relaxed))
+                  return false;
+
+               size_t n = (end_ - next)/divisor_;
+               if (n < grain_)
+                  n = grain_;
+               end = n < end_ - next ? next + n : end_;
+            } while (!next_.compare_exchange_weak(next, end, std::memory_order_relaxed));
+
+            bgn = next;
+            return true;
+         }
+
+         // Record the first exception and stop issuing chunks.
+         void fail(const std::exception_ptr& e) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!exception_)
+               exception_ = e;
+            failed_ = true;
+         }
+
+         // Returns true for the last helper to finish.
+         bool finish() {
+            return helpers_.fetch_sub(1) == 1;
+         }
+      };
+
+      template<typename F>
+      struct ParallelFor : ParallelRange {
+         F body_;
+
+         ParallelFor(size_t bgn, size_t end, size_t grain, size_t nHelpers, const F& body)
+            : ParallelRange(bgn, end, grain, nHelpers)
+            , body_(body) {
+         }
+
+         void help() {
+            try {
+               size_t bgn, end;
+               while (claim(bgn, end)) {
+                  for (size_t i = bgn; i < end; ++i)
+                     body_(i);
+               }
+            }
+            catch (...) {
+               fail(std::current_exception());
+            }
+
+            if (finish()) {
+               if (exception_)
+                  promise_.settle(exception_);
+               else
+                  promise_.settle();
+            }
+         }
+      };
+
+      template<typename T, typename F, typename C>
+      struct ParallelReduce : ParallelRange {
+         const T identity_;
+         F body_;
+         C combine_;
+
+         // Partial results keyed by chunk start so they can be
+         // combined in range order, which requires combine only to
+         // be associative and not also commutative.
+         std::vector<std::pair<size_t, T> > partials_;
+
+         ParallelReduce(size_t bgn, size_t end, size_t grain, size_t nHelpers,
+                        const T& identity, const F& body, const C& combine)
+            : ParallelRange(bgn, end, grain, nHelpers)
+            , identity_(identity)
+            , body_(body)
+            , combine_(combine) {
+         }
+
+         void help() {
+            try {
+               std::vector<std::pair<size_t, T> > partials;
+               size_t bgn, end;
+               while (claim(bgn, end)) {
+                  T value = body_(bgn);
+                  for (size_t i = bgn + 1; i < end; ++i)
+                     value = combine_(std::move(value), body_(i));
+                  partials.emplace_back(bgn, std::move(value));
+               }
+
+               std::lock_guard<std::mutex> lock(mutex_);
+               std::move(partials.begin(), partials.end(), std::back_inserter(partials_));
+            }
+            catch (...) {
+               fail(std::current_exception());
+            }
+
+            if (finish()) {
+               if (exception_) {
+                  promise_.settle(exception_);
+                  return;
+               }
+
+               try {
+                  std::sort(
+                     partials_.begin(), partials_.end(),
+                     [](const std::pair<size_t, T>& a, const std::pair<size_t, T>& b) {
+                        return a.first < b.first;
+                     });
+
+                  T value = identity_;
+                  for (auto& partial : partials_)
+                     value = combine_(std::move(value), std::move(partial.second));
+                  promise_.settle(std::move(value));
+               }
+               catch (...) {
+                  promise_.settle(std::current_exception());
+               }
+            }
+         }
+      };
+
+
+      // Post the helper jobs for a parallel loop. A pool at capacity
+      // may reject them, in which case they run in this thread.
+      template<typename TP, typename C>
+      void postHelpers(TP& pool, size_t nHelpers, const std::shared_ptr<C>& context) {
+         auto helpers = pool.postN(nHelpers, [=](size_t) {
+            context->help();
+            return nullptr;
+         });
+         for (auto& helper : helpers) {
+            helper.except([=](const std::exception_ptr&) {
+               context->help();
+               return nullptr;
+            });
+         }
+      }
+   }
+}
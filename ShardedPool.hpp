@@ -0,0 +1,412 @@
+/*
+Copyright 2015 Shoestring Research, LLC.  All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef poolqueue_ShardedPool_hpp
+#define poolqueue_ShardedPool_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "ThreadPool.hpp"
+
+namespace poolqueue {
+
+   // Shared-nothing pool with one thread per shard.
+   //
+   // Each shard is a thread, by default pinned to its own physical
+   // core, with a private run queue. Jobs are sent to a specific
+   // shard with submitTo(). Between shards, jobs travel through a
+   // single-producer single-consumer ring for each ordered pair of
+   // shards, so a busy shard takes no locks and shares no written
+   // cache lines except with the ring's one peer. A job that finds
+   // its ring full waits in the sender's private overflow queue
+   // until there is room. A shard with nothing to do sleeps, and
+   // only then does a sender take the shard's lock to wake it.
+   //
+   // Submissions from threads outside the pool are not on the hot
+   // path; they go through a locked inbox on the target shard.
+   class ShardedPool {
+   public:
+      // Construct a pool.
+      // @nShards Number of shards (threads).
+      // @cpuSets CPU sets for thread placement. Shard i is pinned
+      //          to cpuSets[i % cpuSets.size()]. The default is one
+      //          set per physical core; an empty vector leaves the
+      //          threads unpinned.
+      explicit ShardedPool(unsigned int nShards = std::max(std::thread::hardware_concurrency(), 1U),
+                           std::vector<std::vector<int> > cpuSets = detail::cpuGroups(false))
+         : cpuSets_(std::move(cpuSets)) {
+         nShards = std::max(nShards, 1U);
+         for (unsigned int i = 0; i < nShards; ++i)
+            shards_.emplace_back(new Shard(nShards));
+         for (unsigned int i = 0; i < nShards*nShards; ++i)
+            rings_.emplace_back(i/nShards != i%nShards ? new Ring(RingSize) : nullptr);
+
+         try {
+            for (unsigned int i = 0; i < nShards; ++i)
+               shards_[i]->thread_ = std::thread(&ShardedPool::run, this, i);
+         }
+         catch (...) {
+            stop();
+            throw;
+         }
+      }
+
+      ShardedPool(const ShardedPool&) = delete;
+      ShardedPool& operator=(const ShardedPool&) = delete;
+
+      // Destructor.
+      //
+      // Jobs already submitted, and jobs they submit, are run
+      // before the destructor returns. No job may be submitted
+      // from outside the pool once destruction begins.
+      ~ShardedPool() {
+         // Every job is counted as sent before it is queued and as
+         // done after it runs, and a job's own submissions are sent
+         // before it is done. So reading the done counts before the
+         // sent counts and finding them equal means nothing is
+         // queued or running.
+         while (true) {
+            uint64_t done = 0;
+            for (const auto& shard : shards_)
+               done += shard->done_.load(std::memory_order_acquire);
+            uint64_t sent = externalSent_.load();
+            for (const auto& shard : shards_)
+               sent += shard->sent_.load();
+            if (done == sent)
+               break;
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+         }
+         stop();
+      }
+
+      // Get the number of shards.
+      unsigned int getShardCount() const {
+         return static_cast<unsigned int>(shards_.size());
+      }
+
+      // Get the current shard index.
+      //
+      // @return Index of the calling shard thread, or -1 if not
+      //         called from this pool.
+      int index() const {
+         const Current& current = currentThread();
+         return current.pool_ == this ? static_cast<int>(current.index_) : -1;
+      }
+
+      // Run a job on a specific shard.
+      // @shard Index of the shard to run the job.
+      // @f     Function or functor to run.
+      //
+      // Called from a shard, the returned Promise is settled on the
+      // calling shard, so its callbacks run there rather than on
+      // the target. Called from another thread, it is settled on the
+      // target shard.
+      //
+      // @return Promise that fulfils or rejects with the outcome
+      //         of the function argument.
+      template<typename F>
+      Promise submitTo(unsigned int shard, F&& f) {
+         typedef typename detail::CallableTraits<F>::ArgumentType Argument;
+         typedef typename detail::CallableTraits<F>::ResultType Result;
+         static_assert(std::is_same<Argument, void>::value,
+                       "function must take no argument");
+         static_assert(!std::is_same<Result, void>::value,
+                       "function must return a value");
+         if (shard >= shards_.size())
+            throw std::out_of_range("invalid shard");
+
+         Promise job(std::forward<F>(f));
+         const Current& current = currentThread();
+         if (current.pool_ != this) {
+            sendExternal(shard, detail::Task(detail::SettlePromise{job}));
+            return job;
+         }
+
+         const unsigned int source = current.index_;
+         if (source == shard) {
+            send(source, shard, detail::Task(detail::SettlePromise{job}));
+            return job;
+         }
+
+         // The result Promise adopts the state of the job when it
+         // is settled back on the source shard.
+         Promise result([job]() {
+            return job;
+         });
+         send(source, shard, detail::Task(Reply{ this, job, result, source, shard }));
+         return result;
+      }
+
+   private:
+      static constexpr size_t RingSize = 256;
+      static constexpr unsigned int SpinLimit = 64;
+
+      typedef detail::SpscRing<detail::Task> Ring;
+
+      struct Shard {
+         std::thread thread_;
+
+         // Accessed only by the shard thread.
+         std::deque<detail::Task> local_;
+         std::vector<std::deque<detail::Task> > outbox_;
+         size_t outboxSize_;
+
+         // Written only by the shard thread.
+         std::atomic<uint64_t> sent_;
+         std::atomic<uint64_t> done_;
+
+         // Sleeping and the external inbox.
+         std::atomic<bool> sleeping_;
+         std::atomic<bool> hasInbox_;
+         std::mutex mutex_;
+         std::condition_variable condition_;
+         bool wake_;
+         std::deque<detail::Task> inbox_;
+
+         explicit Shard(unsigned int nShards)
+            : outbox_(nShards)
+            , outboxSize_(0)
+            , sent_(0)
+            , done_(0)
+            , sleeping_(false)
+            , hasInbox_(false)
+            , wake_(false) {
+         }
+      };
+
+      struct Current {
+         const ShardedPool *pool_;
+         unsigned int index_;
+      };
+
+      static Current& currentThread() {
+         static thread_local Current current = { nullptr, 0 };
+         return current;
+      }
+
+      // Runs a job on the target shard and sends the result Promise
+      // back to the source shard to settle.
+      struct Reply {
+         ShardedPool *pool_;
+         Promise job_;
+         Promise result_;
+         unsigned int source_;
+         unsigned int target_;
+
+         void operator()() const {
+            job_.settle();
+            pool_->send(target_, source_, detail::Task(detail::SettlePromise{result_}));
+         }
+      };
+
+      const std::vector<std::vector<int> > cpuSets_;
+      std::vector<std::unique_ptr<Shard> > shards_;
+      std::vector<std::unique_ptr<Ring> > rings_;
+      std::atomic<uint64_t> externalSent_{0};
+      std::atomic<bool> stopping_{false};
+
+      Ring& ring(unsigned int from, unsigned int to) {
+         return *rings_[from*shards_.size() + to];
+      }
+
+      // Only the owning shard writes its counters, so no atomic
+      // read-modify-write is needed. The release store of done_
+      // publishes the sent_ counts of the jobs it ran, which the
+      // destructor relies on.
+      static void increment(std::atomic<uint64_t>& counter) {
+         counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+      }
+
+      // Queue a job from one shard to another (or itself). Called on
+      // the source shard thread.
+      void send(unsigned int from, unsigned int to, detail::Task&& task) {
+         // The job must be counted before the target can run it.
+         Shard& source = *shards_[from];
+         increment(source.sent_);
+         try {
+            if (from == to) {
+               source.local_.push_back(std::move(task));
+               return;
+            }
+
+            // Keep order behind jobs already waiting for the ring.
+            auto& outbox = source.outbox_[to];
+            if (!outbox.empty() || !ring(from, to).push(std::move(task))) {
+               outbox.push_back(std::move(task));
+               ++source.outboxSize_;
+               return;
+            }
+         }
+         catch (...) {
+            source.sent_.store(source.sent_.load(std::memory_order_relaxed) - 1, std::memory_order_relaxed);
+            throw;
+         }
+         wake(to);
+      }
+
+      void sendExternal(unsigned int to, detail::Task&& task) {
+         Shard& target = *shards_[to];
+         std::lock_guard<std::mutex> lock(target.mutex_);
+         target.inbox_.push_back(std::move(task));
+         externalSent_.fetch_add(1);
+         target.hasInbox_ = true;
+         target.wake_ = true;
+         target.condition_.notify_one();
+      }
+
+      // Wake a shard if it is sleeping. The fence pairs with the
+      // one in run() so either this thread sees the sleeper or the
+      // sleeper sees the new job.
+      void wake(unsigned int to) {
+         Shard& target = *shards_[to];
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+         if (target.sleeping_.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(target.mutex_);
+            target.wake_ = true;
+            target.condition_.notify_one();
+         }
+      }
+
+      // Move jobs waiting for full rings into the rings.
+      void flush(unsigned int from) {
+         Shard& source = *shards_[from];
+         for (unsigned int to = 0; to < source.outbox_.size() && source.outboxSize_; ++to) {
+            auto& outbox = source.outbox_[to];
+            bool sent = false;
+            while (!outbox.empty() && ring(from, to).push(std::move(outbox.front()))) {
+               outbox.pop_front();
+               --source.outboxSize_;
+               sent = true;
+            }
+            if (sent)
+               wake(to);
+         }
+      }
+
+      void execute(Shard& shard, detail::Task& task) {
+         task.run();
+         increment(shard.done_);
+      }
+
+      bool hasWork(unsigned int i) {
+         Shard& shard = *shards_[i];
+         if (!shard.local_.empty() || shard.hasInbox_.load(std::memory_order_relaxed))
+            return true;
+         for (unsigned int from = 0; from < shards_.size(); ++from) {
+            if (from != i && !ring(from, i).empty())
+               return true;
+         }
+         return false;
+      }
+
+      void stop() {
+         stopping_ = true;
+         for (unsigned int i = 0; i < shards_.size(); ++i) {
+            Shard& shard = *shards_[i];
+            {
+               std::lock_guard<std::mutex> lock(shard.mutex_);
+               shard.wake_ = true;
+               shard.condition_.notify_one();
+            }
+            if (shard.thread_.joinable())
+               shard.thread_.join();
+         }
+      }
+
+      void run(unsigned int i) {
+         currentThread() = { this, i };
+         if (!cpuSets_.empty())
+            detail::setThreadAffinity(cpuSets_[i % cpuSets_.size()]);
+
+         Shard& shard = *shards_[i];
+         const unsigned int nShards = static_cast<unsigned int>(shards_.size());
+         unsigned int spins = 0;
+         detail::Task task;
+         while (true) {
+            bool worked = false;
+
+            // Take a bounded number of jobs from each peer so no
+            // peer is starved.
+            for (unsigned int from = 0; from < nShards; ++from) {
+               if (from == i)
+                  continue;
+               Ring& inbound = ring(from, i);
+               for (size_t n = 0; n < RingSize && inbound.pop(task); ++n) {
+                  execute(shard, task);
+                  worked = true;
+               }
+            }
+
+            // Run local jobs present now; jobs they add wait for
+            // the next pass.
+            for (size_t n = shard.local_.size(); n; --n) {
+               task = std::move(shard.local_.front());
+               shard.local_.pop_front();
+               execute(shard, task);
+               worked = true;
+            }
+
+            if (shard.hasInbox_.load(std::memory_order_acquire)) {
+               std::deque<detail::Task> inbox;
+               {
+                  std::lock_guard<std::mutex> lock(shard.mutex_);
+                  inbox.swap(shard.inbox_);
+                  shard.hasInbox_ = false;
+               }
+               for (auto& t : inbox)
+                  execute(shard, t);
+               worked = true;
+            }
+
+            if (shard.outboxSize_)
+               flush(i);
+
+            // Spin briefly before sleeping, and never sleep with
+            // undelivered jobs.
+            if (worked || shard.outboxSize_ || ++spins < SpinLimit) {
+               if (worked)
+                  spins = 0;
+               else
+                  std::this_thread::yield();
+               continue;
+            }
+            spins = 0;
+
+            shard.sleeping_.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (!hasWork(i)) {
+               if (stopping_)
+                  break;
+
+               std::unique_lock<std::mutex> lock(shard.mutex_);
+               shard.condition_.wait(lock, [&]() { return shard.wake_; });
+               shard.wake_ = false;
+            }
+            shard.sleeping_.store(false, std::memory_order_relaxed);
+         }
+      }
+   };
+
+} // namespace poolqueue
+
+#endif // poolqueue_ShardedPool_hpp
@@ -0,0 +1,194 @@
+/*
+Copyright 2015 Shoestring Research, LLC.  All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef poolqueue_Strand_hpp
+#define poolqueue_Strand_hpp
+
+#include <atomic>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include "Promise.hpp"
+
+namespace poolqueue {
+
+   // Serialized execution on a ThreadPool.
+   //
+   // A Strand invokes functions in the order they are posted,
+   // asynchronously on a ThreadPool, with no concurrency among
+   // them. This can be useful, for example, in managing access to a
+   // resource without blocking.
+   //
+   // Posted functions go into a lock-free mailbox. Whenever the
+   // mailbox goes from empty to non-empty, a single job is posted to
+   // the ThreadPool that runs the queued functions back-to-back
+   // until the mailbox is empty. To share the pool fairly, that job
+   // re-posts itself after running MaxBatch functions if more
+   // remain.
+   //
+   // A Strand instance is a handle to shared state, so it can be
+   // copied and the state lives until all queued functions have
+   // run.
+   template<typename TP>
+   class Strand {
+   public:
+      static constexpr size_t MaxBatch = 64;
+
+      // Construct a Strand.
+      // @pool ThreadPool (any ThreadPoolT instantiation) to run on.
+      //       The ThreadPool must outlive all posted functions.
+      Strand(TP& pool)
+         : pimpl(std::make_shared<Pimpl>(pool)) {
+      }
+
+      // Post (enqueue) a job.
+      // @f Function or functor to run.
+      //
+      // The function will run on a ThreadPool thread after all
+      // functions previously posted to this Strand have completed.
+      //
+      // Note that callbacks attached to the returned Promise are not
+      // serialized with the Strand.
+      //
+      // @return Promise that fulfils or rejects with the outcome
+      //         of the function argument.
+      template<typename F>
+      Promise post(F&& f) {
+         typedef typename detail::CallableTraits<F>::ArgumentType Argument;
+         typedef typename detail::CallableTraits<F>::ResultType Result;
+         static_assert(std::is_same<Argument, void>::value,
+                       "function must take no argument");
+         static_assert(!std::is_same<Result, void>::value,
+                       "function must return a value");
+
+         Node *node = new Node(std::forward<F>(f));
+         Promise p = node->promise_;
+         Pimpl::push(pimpl, node);
+         return p;
+      }
+
+   private:
+      struct Node {
+         template<typename F>
+         Node(F&& f)
+            : promise_(std::forward<F>(f))
+            , next_(nullptr) {
+         }
+
+         Promise promise_;
+         Node *next_;
+      };
+
+      struct Pimpl {
+         TP& pool_;
+
+         // Functions posted but not yet run. A drain job is active
+         // exactly when this is non-zero.
+         std::atomic<size_t> count_;
+
+         // Most recently pushed node. Producers only push and the
+         // single consumer takes the whole list at once, so a
+         // simple compare-and-swap list has no ABA problem.
+         std::atomic<Node *> head_;
+
+         Pimpl(TP& pool)
+            : pool_(pool)
+            , count_(0)
+            , head_(nullptr) {
+         }
+
+         ~Pimpl() {
+            Node *node = head_.load(std::memory_order_relaxed);
+            while (node) {
+               Node *next = node->next_;
+               delete node;
+               node = next;
+            }
+         }
+
+         static void push(const std::shared_ptr<Pimpl>& pimpl, Node *node) {
+            // If the count was zero then no drain job is active, so
+            // start one once the node is in place.
+            const bool idle = pimpl->count_.fetch_add(1) == 0;
+
+            node->next_ = pimpl->head_.load(std::memory_order_relaxed);
+            while (!pimpl->head_.compare_exchange_weak(
+                      node->next_, node,
+                      std::memory_order_release, std::memory_order_relaxed))
+               ;
+
+            if (idle)
+               schedule(pimpl);
+         }
+
+         static void schedule(const std::shared_ptr<Pimpl>& pimpl) {
+            try {
+               pimpl->pool_.execute([pimpl]() {
+                  drain(pimpl);
+               });
+            }
+            catch (const std::length_error&) {
+               // The pool is at capacity so run here instead.
+               drain(pimpl);
+            }
+         }
+
+         static void drain(const std::shared_ptr<Pimpl>& pimpl) {
+            size_t total = 0;
+            while (total < MaxBatch) {
+               // Take everything queued and reverse it into posting
+               // order.
+               Node *node = pimpl->head_.exchange(nullptr, std::memory_order_acquire);
+               Node *list = nullptr;
+               while (node) {
+                  Node *next = node->next_;
+                  node->next_ = list;
+                  list = node;
+                  node = next;
+               }
+
+               // A node may be counted but not yet pushed, in which
+               // case its producer is about to finish.
+               if (!list) {
+                  std::this_thread::yield();
+                  continue;
+               }
+
+               size_t n = 0;
+               while (list) {
+                  std::unique_ptr<Node> current(list);
+                  list = list->next_;
+                  current->promise_.settle();
+                  ++n;
+               }
+
+               // Stop if nothing was posted in the meantime.
+               if (pimpl->count_.fetch_sub(n) == n)
+                  return;
+               total += n;
+            }
+
+            // Let other pool jobs run before continuing.
+            schedule(pimpl);
+         }
+      };
+
+      std::shared_ptr<Pimpl> pimpl;
+   };
+
+} // namespace poolqueue
+
+#endif // poolqueue_Strand_hpp
@@ -0,0 +1,294 @@
+/*
+Copyright 2015 Shoestring Research, LLC.  All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef poolqueue_TaskGraph_hpp
+#define poolqueue_TaskGraph_hpp
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+
+#include "Promise.hpp"
+
+namespace poolqueue {
+
+   // Static dependency graph of tasks on a ThreadPool.
+   //
+   // Nodes and edges are added up front, then run() executes every
+   // node on the pool, each after all of its predecessors. In-degrees
+   // are computed once, so a run only copies them into atomic
+   // counters; a node that completes decrements the counters of its
+   // successors and posts those that reach zero. No Promise is
+   // created per node or edge.
+   //
+   // The same graph can be run again after the previous run
+   // completes. The graph must not be modified while running and
+   // must outlive the run.
+   template<typename TP>
+   class TaskGraph {
+   public:
+      typedef size_t Node;
+
+      // Constructor.
+      // @pool ThreadPool to run tasks.
+      explicit TaskGraph(TP& pool)
+         : pool_(pool)
+         , running_(false)
+         , checked_(true) {
+      }
+
+      TaskGraph(const TaskGraph&) = delete;
+      TaskGraph& operator=(const TaskGraph&) = delete;
+
+      // Add a node.
+      // @f Function or functor with signature void f().
+      //
+      // @return Node identifier.
+      template<typename F>
+      Node add(F&& f) {
+         checkIdle();
+         nodes_.emplace_back(std::forward<F>(f));
+         checked_ = false;
+         return nodes_.size() - 1;
+      }
+
+      // Add an edge.
+      // @from Node that must complete first.
+      // @to   Node that must run after.
+      void precede(Node from, Node to) {
+         checkIdle();
+         if (from >= nodes_.size() || to >= nodes_.size())
+            throw std::out_of_range("invalid node");
+
+         nodes_[from].successors_.push_back(to);
+         ++nodes_[to].inDegree_;
+         checked_ = false;
+      }
+
+      // Get the number of nodes.
+      size_t size() const {
+         return nodes_.size();
+      }
+
+      // Run the graph.
+      //
+      // If a node throws an exception, nodes that have not started
+      // are skipped and the returned Promise rejects with the first
+      // exception. A graph with a cycle throws std::logic_error.
+      // A node that the pool rejects for lack of capacity runs in
+      // the thread that made it ready, which may be the caller.
+      //
+      // @return Promise that fulfils (with an empty value) when all
+      //         nodes have completed.
+      Promise run() {
+         checkIdle();
+         if (!checked_) {
+            checkAcyclic();
+            counters_.reset(new std::atomic<size_t>[nodes_.size()]);
+            checked_ = true;
+         }
+
+         if (nodes_.empty())
+            return Promise().settle();
+
+         for (size_t i = 0; i < nodes_.size(); ++i)
+            counters_[i].store(nodes_[i].inDegree_, std::memory_order_relaxed);
+         remaining_.store(nodes_.size(), std::memory_order_relaxed);
+         failed_.store(false, std::memory_order_relaxed);
+         exception_ = nullptr;
+
+         // Keep a reference in case the last node completes (and
+         // releases promise_) before this returns.
+         Promise result;
+         promise_ = result;
+         running_.store(true, std::memory_order_release);
+         Worklist list(this);
+         for (size_t i = 0; i < nodes_.size(); ++i) {
+            if (nodes_[i].inDegree_ == 0)
+               schedule(i);
+         }
+         drain(list);
+         return result;
+      }
+
+   private:
+      struct NodeData {
+         std::function<void()> f_;
+         std::vector<Node> successors_;
+         size_t inDegree_;
+
+         template<typename F>
+         explicit NodeData(F&& f)
+            : f_(std::forward<F>(f))
+            , inDegree_(0) {
+         }
+      };
+
+      TP& pool_;
+      std::vector<NodeData> nodes_;
+      std::atomic<bool> running_;
+      bool checked_;
+
+      // Per-run state.
+      std::unique_ptr<std::atomic<size_t>[]> counters_;
+      std::atomic<size_t> remaining_;
+      std::atomic<bool> failed_;
+      std::mutex mutex_;
+      std::exception_ptr exception_;
+      Promise promise_;
+
+      void checkIdle() const {
+         if (running_.load(std::memory_order_acquire))
+            throw std::logic_error("TaskGraph is running");
+      }
+
+      // Kahn's algorithm; all nodes are visited iff there is no
+      // cycle.
+      void checkAcyclic() const {
+         std::vector<size_t> inDegree(nodes_.size());
+         std::vector<Node> ready;
+         for (size_t i = 0; i < nodes_.size(); ++i) {
+            inDegree[i] = nodes_[i].inDegree_;
+            if (inDegree[i] == 0)
+               ready.push_back(i);
+         }
+
+         size_t visited = 0;
+         while (!ready.empty()) {
+            const Node node = ready.back();
+            ready.pop_back();
+            ++visited;
+            for (Node successor : nodes_[node].successors_) {
+               if (--inDegree[successor] == 0)
+                  ready.push_back(successor);
+            }
+         }
+
+         if (visited != nodes_.size())
+            throw std::logic_error("TaskGraph has a cycle");
+      }
+
+      // Nodes to run on this thread. While a thread is running nodes
+      // of a graph, nodes that the pool hands back to it (rejected,
+      // or run by the caller under Overflow::CallerRuns) are added
+      // to its list rather than run recursively, so a long chain on
+      // a full pool doesn't grow the stack.
+      struct Worklist {
+         TaskGraph *graph_;
+         Worklist *outer_;
+         std::vector<Node> nodes_;
+
+         explicit Worklist(TaskGraph *graph)
+            : graph_(graph)
+            , outer_(current()) {
+            current() = this;
+         }
+
+         static Worklist*& current() {
+            static thread_local Worklist *list = nullptr;
+            return list;
+         }
+      };
+
+      // Run the listed nodes, including any they add, then restore
+      // the outer list. This doesn't touch members, as the graph
+      // may be gone once its last node completes.
+      static void drain(Worklist& list) {
+         while (!list.nodes_.empty()) {
+            const Node node = list.nodes_.back();
+            list.nodes_.pop_back();
+            list.graph_->complete(node);
+         }
+         Worklist::current() = list.outer_;
+      }
+
+      // A node that can't be queued still runs through execute(),
+      // so the run always completes and clears running_.
+      void schedule(Node node) {
+         try {
+            pool_.execute([this, node]() {
+               execute(node);
+            });
+         }
+         catch (const std::length_error&) {
+            // The pool is at capacity so run here instead.
+            execute(node);
+         }
+         catch (...) {
+            // Fail the run; the node and the rest are skipped.
+            fail(std::current_exception());
+            execute(node);
+         }
+      }
+
+      void fail(const std::exception_ptr& e) {
+         std::lock_guard<std::mutex> lock(mutex_);
+         if (!failed_.exchange(true))
+            exception_ = e;
+      }
+
+      void execute(Node node) {
+         Worklist *current = Worklist::current();
+         if (current && current->graph_ == this) {
+            current->nodes_.push_back(node);
+            return;
+         }
+
+         Worklist list(this);
+         complete(node);
+         drain(list);
+      }
+
+      // Run a node and schedule the successors it makes ready.
+      void complete(Node node) {
+         const NodeData& data = nodes_[node];
+         if (!failed_.load(std::memory_order_relaxed)) {
+            try {
+               data.f_();
+            }
+            catch (...) {
+               fail(std::current_exception());
+            }
+         }
+
+         for (Node successor : data.successors_) {
+            if (counters_[successor].fetch_sub(1, std::memory_order_acq_rel) == 1)
+               schedule(successor);
+         }
+
+         if (remaining_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            // The graph may be run again (or destroyed) as soon as
+            // the Promise settles, so finish with members first.
+            Promise promise;
+            std::swap(promise, promise_);
+            std::exception_ptr e;
+            std::swap(e, exception_);
+            running_.store(false, std::memory_order_release);
+
+            if (e)
+               promise.settle(e);
+            else
+               promise.settle();
+         }
+      }
+   };
+
+} // namespace poolqueue
+
+#endif // poolqueue_TaskGraph_hpp
@@ -0,0 +1,217 @@
+/*
+Copyright 2015 Shoestring Research, LLC.  All rights reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+#ifndef poolqueue_TaskGroup_hpp
+#define poolqueue_TaskGroup_hpp
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+#include "ThreadPool.hpp"
+
+namespace poolqueue {
+
+   // Fork-join group of tasks on a ThreadPool.
+   //
+   // spawn() adds a task to the group and wait() returns when all
+   // spawned tasks have completed. This is intended for recursive
+   // divide-and-conquer, where a task spawns subtasks and waits for
+   // them:
+   //
+   //   long fib(ThreadPool& tp, int n) {
+   //     if (n < 2)
+   //       return n;
+   //     long a, b;
+   //     TaskGroup<ThreadPool> group(tp);
+   //     group.spawn([&]() { a = fib(tp, n - 1); });
+   //     b = fib(tp, n - 2);
+   //     group.wait();
+   //     return a + b;
+   //   }
+   //
+   // Spawned tasks are kept in a deque owned by the group rather
+   // than the pool queue, and no Promise is created per task. For
+   // each task, a small job is posted to the pool that takes the
+   // oldest remaining task, if any, so idle threads steal the
+   // largest pieces of work. The thread calling wait() runs the
+   // newest remaining tasks itself instead of blocking, so waiting
+   // in a pool thread does not deadlock. Only if its remaining
+   // tasks were taken by other threads does it wait, and then as
+   // ThreadPoolT::blocking() so the pool can compensate.
+   //
+   // spawn() and wait() should be called from a single thread.
+   template<typename TP>
+   class TaskGroup {
+   public:
+      // Constructor.
+      // @pool ThreadPool to run tasks.
+      explicit TaskGroup(TP& pool)
+         : state_(std::make_shared<State>(pool)) {
+      }
+
+      TaskGroup(const TaskGroup&) = delete;
+      TaskGroup& operator=(const TaskGroup&) = delete;
+
+      // Destructor.
+      //
+      // Waits for spawned tasks. Exceptions are discarded, so
+      // call wait() explicitly to receive them.
+      ~TaskGroup() {
+         try {
+            wait();
+         }
+         catch (...) {
+         }
+      }
+
+      // Add a task.
+      // @f Function or functor with signature void f(). It must
+      //    remain valid until wait() returns.
+      //
+      // If the pool rejects the job for lack of capacity, the task
+      // still runs, either in wait() or taken by another job.
+      template<typename F>
+      void spawn(F&& f) {
+         State& state = *state_;
+         state.pending_.fetch_add(1, std::memory_order_relaxed);
+         {
+            std::lock_guard<detail::SpinLock> lock(state.lock_);
+            state.tasks_.emplace_back(Guard<typename std::decay<F>::type>{ std::forward<F>(f), &state });
+         }
+
+         std::shared_ptr<State> shared(state_);
+         try {
+            state.pool_.execute([shared]() {
+               detail::Task task;
+               if (shared->take(task, false))
+                  task.run();
+            });
+         }
+         catch (const std::length_error&) {
+            // The task is already queued in the group.
+         }
+      }
+
+      // Wait for all spawned tasks.
+      //
+      // If any task threw an exception, the first one is rethrown
+      // here (once).
+      void wait() {
+         State& state = *state_;
+         detail::Task task;
+         while (state.take(task, true))
+            task.run();
+
+         // Remaining tasks are running on other threads, and are
+         // likely to finish soon.
+         for (unsigned int i = 0; i < SpinLimit && state.pending_.load(std::memory_order_acquire); ++i)
+            std::this_thread::yield();
+
+         if (state.pending_.load(std::memory_order_acquire)) {
+            state.pool_.blocking([&]() {
+               std::unique_lock<std::mutex> lock(state.mutex_);
+               state.condition_.wait(lock, [&]() {
+                  return state.pending_.load(std::memory_order_acquire) == 0;
+               });
+               return nullptr;
+            });
+         }
+
+         if (state.exception_) {
+            std::exception_ptr e;
+            std::swap(e, state.exception_);
+            std::rethrow_exception(e);
+         }
+      }
+
+   private:
+      static constexpr unsigned int SpinLimit = 64;
+
+      struct State {
+         TP& pool_;
+         detail::SpinLock lock_;
+         std::deque<detail::Task> tasks_;
+         std::atomic<size_t> pending_;
+
+         std::mutex mutex_;
+         std::condition_variable condition_;
+         std::exception_ptr exception_;
+
+         explicit State(TP& pool)
+            : pool_(pool)
+            , pending_(0) {
+         }
+
+         // Take the newest (owner) or oldest (thief) task.
+         bool take(detail::Task& task, bool newest) {
+            std::lock_guard<detail::SpinLock> lock(lock_);
+            if (tasks_.empty())
+               return false;
+
+            if (newest) {
+               task = std::move(tasks_.back());
+               tasks_.pop_back();
+            }
+            else {
+               task = std::move(tasks_.front());
+               tasks_.pop_front();
+            }
+            return true;
+         }
+
+         void complete(std::exception_ptr e) {
+            if (e) {
+               std::lock_guard<std::mutex> lock(mutex_);
+               if (!exception_)
+                  exception_ = e;
+            }
+
+            if (pending_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+               std::lock_guard<std::mutex> lock(mutex_);
+               condition_.notify_all();
+            }
+         }
+      };
+
+      // Task wrapper that records completion and exceptions.
+      template<typename F>
+      struct Guard {
+         F f_;
+         State *state_;
+
+         void operator()() {
+            std::exception_ptr e;
+            try {
+               f_();
+            }
+            catch (...) {
+               e = std::current_exception();
+            }
+            state_->complete(e);
+         }
+      };
+
+      std::shared_ptr<State> state_;
+   };
+
+} // namespace poolqueue
+
+#endif // poolqueue_TaskGroup_hpp
@@ -16,13 +16,31 @@ limitations under the License.
 #ifndef poolqueue_ThreadPool_hpp
 #define poolqueue_ThreadPool_hpp
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
 #include <deque>
-#include <map>
+#include <fstream>
+#include <functional>
 #include <future>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <type_traits>
+#include <utility>
 #include <vector>
 
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "BlockingPool.hpp"
 #include "Promise.hpp"
 #include "ThreadPool_detail.hpp"
 
@@ -36,17 +54,80 @@ namespace poolqueue {
    //
    // The template argument selects a thread-safe queue class (in
    // certain situations a LIFO queue is preferable to the default
-   // FIFO queue). It must be a default-constructible class with
-   // methods:
+   // FIFO queue). The pool stores its own job type in the queue, so
+   // the class must provide a member alias template rebind<T> for
+   // the queue of T. That must be a default-constructible class
+   // with methods:
+   //
+   //   bool push(T&& t);
+   //   template<typename Iterator> bool push(Iterator bgn, Iterator end);
+   //   bool pop(T& t);
+   //   size_t pop(T *t, size_t n);
    //
-   //   bool push(Promise& p);
-   //   bool pop(Promise& p);
+   // push() should return true if the queue was empty. The range
+   // form of push() should enqueue all the values at once, in
+   // order. pop() should return true if successful. The array form
+   // of pop() should retrieve up to n values at once and return the
+   // number retrieved.
    //
-   // push() should return true if the queue was empty. pop() should
-   // return true if successful.
-   template<typename Q, bool FIFO = true>
+   // A queue class may also accept an additional key argument to
+   // push(), e.g. detail::PriorityQueue takes a priority band and
+   // detail::FairQueue takes a sub-queue name. Such keys can be
+   // passed through post(key, f). detail::DeadlineQueue takes a
+   // deadline, passed through post(deadline, f). A queue class
+   // that takes a key should declare its type as the member Key.
+   //
+   // The Wait argument selects how idle threads wait for jobs:
+   // detail::Blocking (the default) waits on a condition variable,
+   // detail::SpinYield spins and yields briefly first, and
+   // detail::BusySpin never waits. The policy is resolved at
+   // compile time.
+   template<typename Q, bool FIFO = true, typename Wait = detail::Blocking>
    class ThreadPoolT {
    public:
+      typedef detail::deadline_expired deadline_expired;
+      typedef detail::job_cancelled job_cancelled;
+
+      // Runtime metrics from getMetrics().
+      //
+      // Counters and histograms are cumulative since the pool was
+      // constructed, so rates are obtained by differencing
+      // periodic samples. Unless noted, totals include threads that
+      // have since exited. Everything but depth and threads is zero
+      // if compiled with POOLQUEUE_NO_METRICS.
+      struct Metrics {
+         struct Worker {
+            uint64_t jobs;                // jobs run
+            uint64_t steals;              // jobs taken from other threads' next slots
+            std::chrono::nanoseconds busy; // running jobs
+            std::chrono::nanoseconds park; // waiting for notification
+            std::chrono::nanoseconds idle; // neither, e.g. looking for jobs
+         };
+
+         size_t depth;                    // outstanding jobs (as getDepth())
+         unsigned int threads;            // as getThreadCount()
+         uint64_t enqueued;               // jobs queued
+         uint64_t dequeued;               // jobs completed
+         uint64_t steals;
+         detail::Histogram runTime;       // job run time
+         detail::Histogram queueWait;     // time from queued to start (sampled)
+         std::vector<Worker> workers;     // current threads, by index
+      };
+
+      // Action when a job is posted to a pool at capacity.
+      enum class Overflow {
+         Block,      // wait for space
+         Reject,     // reject the Promise with std::length_error
+         CallerRuns  // run the job in the posting thread
+      };
+
+      // Treatment of jobs not yet started by shutdown().
+      enum class Shutdown {
+         Drain,      // run them
+         Cancel,     // reject their Promises with job_cancelled
+         Abandon     // discard them, leaving their Promises unsettled
+      };
+      
       // Construct a pool.
       // @nThreads  Number of threads in the pool. The default
       //            is the hardware concurrency.
@@ -54,13 +135,38 @@ namespace poolqueue {
          setThreadCount(nThreads);
       }
 
+      // Construct a pool with pinned threads.
+      // @nThreads  Number of threads in the pool.
+      // @cpuSets   CPU sets for thread placement. Thread i is
+      //            restricted to cpuSets[i % cpuSets.size()].
+      //
+      // Pinning keeps threads, and the cache lines they touch, from
+      // migrating between cores and sockets. coreCpuSets() and
+      // socketCpuSets() provide sets for one thread per physical
+      // core or threads spread round-robin across sockets. An empty
+      // set leaves a thread unrestricted. Pinning is currently
+      // implemented only on Linux.
+      ThreadPoolT(unsigned int nThreads, std::vector<std::vector<int> > cpuSets)
+         : cpuSets_(std::move(cpuSets)) {
+         setThreadCount(nThreads);
+      }
+
       ThreadPoolT(const ThreadPoolT&) = delete;
       ThreadPoolT(ThreadPoolT&&) = default;
       ThreadPoolT& operator=(const ThreadPoolT&) = delete;
       ThreadPoolT& operator=(ThreadPoolT&&) = default;
       
       // Destructor.
+      //
+      // Queued jobs are run first, unless shutdown() has already
+      // been called. Delayed jobs that are not yet due are
+      // discarded, leaving their Promises unsettled.
       ~ThreadPoolT() {
+         clearWatchdog();
+         if (shutdownThread_.joinable())
+            shutdownThread_.join();
+         clearAutoScale();
+         discardTimers();
          setThreadCountImpl(0);
       }
 
@@ -90,10 +196,276 @@ namespace poolqueue {
                        "function must return a value");
          
          Promise p(std::forward<F>(f));
-         enqueue(p);
+         if (admit(1))
+            enqueueNext(detail::Task(detail::SettlePromise{p}));
+         else
+            overflow(p);
          return p;
       }
 
+      // Post (enqueue) a job with a queue-specific key.
+      // @key Additional argument for the queue, e.g. the priority
+      //      band for detail::PriorityQueue.
+      // @f   Function or functor to run.
+      //
+      // This method is the same as post(f) except that key is passed
+      // to the push() method of the queue class, so it is only
+      // available with a queue class that accepts it.
+      //
+      // @return Promise that fulfils or rejects with the outcome
+      //         of the function argument.
+      template<typename K, typename F>
+      Promise post(const K& key, F&& f) {
+         typedef typename detail::CallableTraits<F>::ArgumentType Argument;
+         typedef typename detail::CallableTraits<F>::ResultType Result;
+         static_assert(std::is_same<Argument, void>::value,
+                       "function must take no argument");
+         static_assert(!std::is_same<Result, void>::value,
+                       "function must return a value");
+         
+         Promise p(std::forward<F>(f));
+         if (admit(1))
+            enqueue(detail::Task(detail::SettlePromise{p}), key);
+         else
+            overflow(p);
+         return p;
+      }
+
+      // Post (enqueue) a job with a deadline.
+      // @deadline Time by which the job should start.
+      // @f        Function or functor to run.
+      //
+      // This method is only available with a queue class that
+      // orders jobs by deadline, i.e. detail::DeadlineQueue. If the
+      // job starts after the deadline the queue's miss count is
+      // incremented, and if the queue is set to reject expired jobs
+      // the returned Promise rejects with deadline_expired instead
+      // of running the function.
+      //
+      // @return Promise that fulfils or rejects with the outcome
+      //         of the function argument.
+      template<typename F>
+      Promise post(std::chrono::steady_clock::time_point deadline, F&& f) {
+         typedef typename detail::CallableTraits<F>::ArgumentType Argument;
+         typedef typename detail::CallableTraits<F>::ResultType Result;
+         static_assert(std::is_same<Argument, void>::value,
+                       "function must take no argument");
+         static_assert(!std::is_same<Result, void>::value,
+                       "function must return a value");
+
+         typedef typename Q::template rebind<detail::Task> Queue;
+         Promise p(detail::DeadlineCall<typename std::decay<F>::type, Queue>{
+               std::forward<F>(f), deadline, &queue_ });
+         if (admit(1))
+            enqueue(detail::Task(detail::SettlePromise{p}), deadline);
+         else
+            overflow(p);
+         return p;
+      }
+
+      // Post a job to run at a specified time.
+      // @time Time at which the job may start.
+      // @f    Function or functor to run.
+      //
+      // The job is held in a timer heap belonging to a pool thread
+      // (the calling thread if it belongs to the pool, otherwise
+      // the threads in turn), so it needs no separate timer thread
+      // or queue hop. That thread runs the job when it is due. Idle
+      // threads wait for the earliest delayed job of any thread and
+      // take it if its own thread is busy, so a job is only late
+      // if every thread is busy.
+      //
+      // Delayed jobs count as outstanding, e.g. for whenIdle(), but
+      // they are not subject to setCapacity(). shutdown() with
+      // Cancel or Abandon applies to delayed jobs immediately, and
+      // shutdown() with Drain or the destructor discards those not
+      // yet due.
+      //
+      // @return Promise that fulfils or rejects with the outcome
+      //         of the function argument.
+      template<typename F>
+      Promise postAt(std::chrono::steady_clock::time_point time, F&& f) {
+         typedef typename detail::CallableTraits<F>::ArgumentType Argument;
+         typedef typename detail::CallableTraits<F>::ResultType Result;
+         static_assert(std::is_same<Argument, void>::value,
+                       "function must take no argument");
+         static_assert(!std::is_same<Result, void>::value,
+                       "function must return a value");
+
+         Promise p(std::forward<F>(f));
+         addTimer(time, detail::Task(detail::SettlePromise{p}));
+         return p;
+      }
+
+      // Post a job to run after a delay.
+      // @delay Any std::chrono::duration.
+      // @f     Function or functor to run.
+      //
+      // This is equivalent to postAt(now + delay, f).
+      //
+      // @return Promise that fulfils or rejects with the outcome
+      //         of the function argument.
+      template<typename Rep, typename Period, typename F>
+      Promise postAfter(const std::chrono::duration<Rep, Period>& delay, F&& f) {
+         return postAt(
+            std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(delay),
+            std::forward<F>(f));
+      }
+
+      // Post (enqueue) a range of jobs.
+      // @bgn Begin iterator over functions or functors.
+      // @end End iterator.
+      //
+      // This method is equivalent to calling post() on each element
+      // of the range, but the entire range is added to the queue at
+      // once and idle threads are notified once.
+      //
+      // @return Promises for each job, in range order. Pass these to
+      //         Promise::all() to get a single combined Promise.
+      template<typename Iterator>
+      std::vector<Promise> postBatch(Iterator bgn, Iterator end) {
+         typedef typename std::iterator_traits<Iterator>::value_type F;
+         typedef typename detail::CallableTraits<F>::ArgumentType Argument;
+         typedef typename detail::CallableTraits<F>::ResultType Result;
+         static_assert(std::is_same<Argument, void>::value,
+                       "function must take no argument");
+         static_assert(!std::is_same<Result, void>::value,
+                       "function must return a value");
+
+         std::vector<Promise> promises;
+         promises.reserve(std::distance(bgn, end));
+         for (auto i = bgn; i != end; ++i)
+            promises.emplace_back(*i);
+         enqueuePromises(promises);
+         return promises;
+      }
+
+      // Post (enqueue) n instances of a job.
+      // @n Number of jobs.
+      // @f Function or functor taking a size_t index argument.
+      //
+      // This method posts f(0), f(1), ..., f(n - 1) as a single
+      // batch, as with postBatch().
+      //
+      // @return Promises for each job, in index order.
+      template<typename F>
+      std::vector<Promise> postN(size_t n, const F& f) {
+         typedef typename detail::CallableTraits<F>::ResultType Result;
+         static_assert(!std::is_same<Result, void>::value,
+                       "function must return a value");
+
+         std::vector<Promise> promises;
+         promises.reserve(n);
+         for (size_t i = 0; i < n; ++i)
+            promises.emplace_back(detail::IndexedCall<typename std::decay<F>::type>(f, i));
+         enqueuePromises(promises);
+         return promises;
+      }
+
+      // Execute a function asynchronously.
+      // @f Function or functor to run.
+      //
+      // Unlike post(), no Promise is created, so the result is
+      // discarded and an exception escaping f calls
+      // std::terminate(). A small function object is stored inside
+      // the queue node, making this the cheapest way to run a job
+      // whose outcome is not needed.
+      //
+      // With the Overflow::Reject policy, a job that does not fit
+      // throws std::length_error from this method.
+      template<typename F>
+      void execute(F&& f) {
+         typedef typename detail::CallableTraits<F>::ArgumentType Argument;
+         static_assert(std::is_same<Argument, void>::value,
+                       "function must take no argument");
+
+         if (admit(1))
+            enqueueNext(detail::Task(std::forward<F>(f)));
+         else if (overflow_ == Overflow::CallerRuns)
+            f();
+         else
+            throw std::length_error("ThreadPool is at capacity");
+      }
+
+      // Post (enqueue) a blocking job.
+      // @f Function or functor to run.
+      //
+      // The function runs on the shared BlockingPool, so it can
+      // block without occupying a thread of this pool. The returned
+      // Promise settles on a thread of this pool, so callbacks
+      // attached to it before then continue here. The job counts as
+      // outstanding for whenIdle() and the capacity limit until its
+      // result is delivered.
+      //
+      // @return Promise that fulfils or rejects with the outcome
+      //         of the function argument.
+      template<typename F>
+      Promise postBlocking(F&& f) {
+         typedef typename detail::CallableTraits<F>::ArgumentType Argument;
+         typedef typename detail::CallableTraits<F>::ResultType Result;
+         static_assert(std::is_same<Argument, void>::value,
+                       "function must take no argument");
+         static_assert(!std::is_same<Result, void>::value,
+                       "function must return a value");
+
+         Promise job(std::forward<F>(f));
+         if (!admit(1)) {
+            overflow(job);
+            return job;
+         }
+
+         // The result Promise adopts the state of the job when it
+         // is settled in this pool.
+         Promise result([job]() {
+            return job;
+         });
+         pending_.fetch_add(1, std::memory_order_relaxed);
+         try {
+            BlockingPool::instance().post([this, job, result]() {
+               job.settle();
+               push(detail::Task(detail::SettlePromise{result}));
+               return nullptr;
+            });
+         }
+         catch (...) {
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            throw;
+         }
+         return result;
+      }
+
+      // Run a function that may block.
+      // @f Function or functor to run.
+      //
+      // Called from a pool thread, this tells the pool that f may
+      // block, e.g. on file I/O or a future, so if no other thread
+      // is idle a spare thread is started to keep the pool's
+      // parallelism while f runs. The spare exits once it is idle
+      // and no longer needed. Spares are not added during
+      // synchronize(). Called from any other thread, this just
+      // runs f.
+      //
+      // @return The value returned by f.
+      template<typename F>
+      auto blocking(F&& f) -> decltype(f()) {
+         if (currentThread().pool_ != this)
+            return f();
+
+         struct Scope {
+            ThreadPoolT *pool_;
+
+            explicit Scope(ThreadPoolT *pool)
+               : pool_(pool) {
+               pool_->beginBlocking();
+            }
+
+            ~Scope() {
+               pool_->endBlocking();
+            }
+         } scope(this);
+         return f();
+      }
+
       // Ensure that a job runs in the thread pool.
       // @f Function or functor to run.
       //
@@ -138,16 +510,32 @@ namespace poolqueue {
       //
       // If the current context is a ThreadPool thread, then return
       // its 0-based index, otherwise -1.
-      int index() {
-         auto i = ids_.find(std::this_thread::get_id());
-         return i != ids_.end() ? i->second : -1;
+      int index() const {
+         const Current& current = currentThread();
+         return current.pool_ == this ? current.index_ : -1;
+      }
+
+      // Get CPU sets, one per physical core available to the
+      // process, for the pinning constructor.
+      //
+      // @return CPU sets, empty if the topology is unknown.
+      static std::vector<std::vector<int> > coreCpuSets() {
+         return detail::cpuGroups(false);
+      }
+
+      // Get CPU sets, one per socket available to the process, for
+      // the pinning constructor.
+      //
+      // @return CPU sets, empty if the topology is unknown.
+      static std::vector<std::vector<int> > socketCpuSets() {
+         return detail::cpuGroups(true);
       }
 
       // Get number of threads in the pool.
       //
       // @return Number of threads.
       unsigned int getThreadCount() {
-         return static_cast<unsigned int>(threads_.size());
+         return static_cast<unsigned int>(threadCount_.load(std::memory_order_relaxed));
       }
 
       // Set number of threads in the pool.
@@ -162,6 +550,221 @@ namespace poolqueue {
          setThreadCountImpl(n);
       }
 
+      // Limit the number of outstanding jobs.
+      // @capacity Maximum number of posted but not completed jobs,
+      //           or 0 for no limit (the default).
+      // @policy   Action for a job posted while at capacity.
+      //
+      // A full pool applies the policy to post(), execute() and the
+      // batch methods. A batch is treated as a unit, and is admitted
+      // whenever the pool is empty even if it exceeds the capacity.
+      // With Overflow::Block, pool threads are never blocked, as
+      // they may be needed to drain the queue, so their jobs are
+      // admitted over capacity. Concurrent producers may overshoot
+      // the capacity by one check each.
+      void setCapacity(size_t capacity, Overflow policy = Overflow::Block) {
+         std::lock_guard<std::mutex> lock(mutex_);
+         overflow_ = policy;
+         capacity_ = capacity;
+         space_.notify_all();
+      }
+
+      // Get the capacity.
+      //
+      // @return Maximum number of outstanding jobs, or 0 for no limit.
+      size_t getCapacity() const {
+         return capacity_.load(std::memory_order_relaxed);
+      }
+
+      // Get the number of outstanding jobs.
+      //
+      // @return Number of jobs posted but not yet completed,
+      //         including running jobs.
+      size_t getDepth() const {
+         return pending_.load(std::memory_order_relaxed);
+      }
+
+      // Get a snapshot of runtime metrics.
+      //
+      // Each thread keeps its own counters, updated without
+      // synchronization, which are aggregated here. This takes the
+      // pool lock, so it is intended for periodic sampling rather
+      // than calling in a tight loop. Counters are read while
+      // threads continue to run, so the snapshot is not atomic.
+      //
+      // @return Metrics snapshot.
+      Metrics getMetrics() {
+         Metrics m = Metrics();
+         std::lock_guard<std::mutex> lock(mutex_);
+#ifndef POOLQUEUE_NO_METRICS
+         const auto now = Clock::now();
+         m.dequeued = exited_.jobs_;
+         m.steals = exited_.steals_;
+         m.runTime = exited_.runTime_;
+         m.queueWait = exited_.queueWait_;
+         for (const auto& worker : workers_) {
+            const auto& w = worker.metrics_;
+            typename Metrics::Worker metrics;
+            metrics.jobs = w.jobs_.get();
+            metrics.steals = w.steals_.get();
+            metrics.busy = std::chrono::nanoseconds(w.busy_.get());
+            metrics.park = std::chrono::nanoseconds(w.park_.get());
+            metrics.idle = std::max(
+               std::chrono::duration_cast<std::chrono::nanoseconds>(now - w.start_) - metrics.busy - metrics.park,
+               std::chrono::nanoseconds(0));
+            m.workers.push_back(metrics);
+
+            m.dequeued += metrics.jobs;
+            m.steals += metrics.steals;
+            detail::Histogram h;
+            detail::WorkerMetrics::get(w.runTime_, h);
+            m.runTime += h;
+            detail::WorkerMetrics::get(w.queueWait_, h);
+            m.queueWait += h;
+         }
+#endif
+         m.depth = getDepth();
+         m.threads = getThreadCount();
+         m.enqueued = m.dequeued + m.depth;
+         return m;
+      }
+
+      // Get the queue.
+      //
+      // This provides access to configuration and statistics
+      // specific to the queue class, e.g. sub-queue weights for
+      // detail::FairQueue.
+      //
+      // @return Queue holding the pool's jobs.
+      typename Q::template rebind<detail::Task>& queue() {
+         return queue_;
+      }
+
+      // Adjust the number of threads automatically.
+      // @minThreads Minimum number of threads.
+      // @maxThreads Maximum number of threads.
+      // @latency    Target queue latency, any std::chrono::duration.
+      // @idle       Idle time before a thread exits, any
+      //             std::chrono::duration.
+      //
+      // When enabled, the pool periodically measures how long a
+      // probe job waits in the queue, at most once per latency
+      // period and only while jobs are backed up. If the wait
+      // exceeds the target, a thread is added (up to maxThreads).
+      // A thread that finds no work for the idle period exits (down
+      // to minThreads). Threads are added and removed by pool
+      // threads, so posting never waits for a resize.
+      //
+      // The current thread count is clamped to the new bounds.
+      // setAutoScale() has the same concurrency restriction as
+      // setThreadCount().
+      template<typename L, typename I>
+      void setAutoScale(unsigned int minThreads, unsigned int maxThreads,
+                        const L& latency, const I& idle) {
+         if (minThreads <= 0 || maxThreads < minThreads)
+            throw std::invalid_argument("invalid thread bounds");
+
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            autoScale_.min_ = minThreads;
+            autoScale_.max_ = maxThreads;
+            autoScale_.idle_ = std::chrono::duration_cast<Clock::duration>(idle);
+            latency_ = std::chrono::duration_cast<Clock::duration>(latency).count();
+            autoScaling_ = true;
+
+            // Switch waiting threads to a timed wait.
+            condition_.notify_all();
+         }
+
+         const auto n = getThreadCount();
+         if (n < minThreads)
+            setThreadCountImpl(minThreads);
+         else if (n > maxThreads)
+            setThreadCountImpl(maxThreads);
+      }
+
+      // Stop adjusting the number of threads automatically.
+      //
+      // The thread count remains at its current value.
+      void clearAutoScale() {
+         std::lock_guard<std::mutex> lock(mutex_);
+         autoScaling_ = false;
+      }
+
+      // Watch for long-running jobs.
+      // @threshold Job run time that triggers the callback.
+      // @callback  Function or functor with signature
+      //            void f(int index, std::chrono::steady_clock::duration elapsed).
+      //
+      // While a watchdog is set, each pool thread records when its
+      // current job started, and a watchdog thread checks them
+      // every half threshold. The callback is invoked on the
+      // watchdog thread, once per job that runs longer than the
+      // threshold, with the index of the pool thread and how long
+      // the job has been running so far. It must not throw or call
+      // setWatchdog()/clearWatchdog(). A job inside blocking() is
+      // still considered running.
+      template<typename Rep, typename Period, typename F>
+      void setWatchdog(const std::chrono::duration<Rep, Period>& threshold, F&& callback) {
+         clearWatchdog();
+
+         std::lock_guard<std::mutex> lock(watchdogMutex_);
+         watchdogThreshold_ = std::chrono::duration_cast<Clock::duration>(threshold);
+         watchdogCallback_ = std::forward<F>(callback);
+         watchdogStop_ = false;
+         watchdogThread_ = std::thread(&ThreadPoolT::watch, this);
+         watching_ = true;
+      }
+
+      // Stop watching for long-running jobs.
+      void clearWatchdog() {
+         std::thread t;
+         {
+            std::lock_guard<std::mutex> lock(watchdogMutex_);
+            watching_ = false;
+            watchdogStop_ = true;
+            watchdogCondition_.notify_all();
+            t.swap(watchdogThread_);
+         }
+
+         if (t.joinable())
+            t.join();
+      }
+
+      // Stop the pool.
+      // @mode     Treatment of jobs that have not started.
+      // @deadline Time at which Drain switches to Cancel.
+      //
+      // Jobs already running always complete. Queued jobs, and jobs
+      // posted until the threads exit, are run, cancelled or
+      // abandoned according to the mode. Cancelled jobs from
+      // execute() are simply discarded, and a rejection from a
+      // cancelled post() must be handled like any other. After the
+      // threads exit, posted jobs never run.
+      //
+      // Delayed jobs from postAt() and postAfter() are cancelled or
+      // abandoned in the same way. With Drain, those not yet due
+      // are discarded, leaving their Promises unsettled, so the
+      // pool need not wait for them.
+      //
+      // This returns immediately; the threads exit in the
+      // background. Calls after the first return the same Promise
+      // and ignore their arguments. Neither setThreadCount() nor
+      // synchronize() may be called after shutdown().
+      //
+      // @return Promise that fulfils (with an empty value) when all
+      //         pool threads have exited.
+      Promise shutdown(
+         Shutdown mode = Shutdown::Drain,
+         std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max()) {
+         std::call_once(shutdownOnce_, [=]() {
+            if (mode != Shutdown::Drain)
+               setStopping(mode);
+            shutdownThread_ = std::thread(&ThreadPoolT::stop, this, deadline);
+         });
+         return shutdown_;
+      }
+
       // Synchronize threads.
       //
       // Ensure that any function scheduled before synchronize()
@@ -178,7 +781,7 @@ namespace poolqueue {
             throw std::logic_error("underlying queue is not FIFO");
          
          // Return a completed future if there are no threads.
-         if (threads_.empty()) {
+         if (getThreadCount() == 0) {
             std::promise<void> promise;
             promise.set_value();
             return std::shared_future<void>(promise.get_future());
@@ -190,7 +793,19 @@ namespace poolqueue {
          // notified. Don't use enqueue() here as it does not
          // necessarily acquire the lock, which is okay for normal use
          // but can produce deadlock with this blocking lambda.
+         //
+         // Worker threads normally retrieve jobs in batches, and a
+         // thread that retrieved two of these lambdas would deadlock.
+         // Raising syncing_ switches workers to single retrieval, and
+         // waiting out any batch retrieval in progress ensures that
+         // none can contain a lambda.
          std::unique_lock<std::mutex> lock(mutex_);
+         ++syncing_;
+         for (const auto& worker : workers_) {
+            while (worker.popping_)
+               std::this_thread::yield();
+         }
+
          auto count = std::make_shared<std::atomic<size_t>>(threads_.size());
          auto promise = std::make_shared<std::promise<void>>();
          std::shared_future<void> future(promise->get_future());
@@ -199,98 +814,491 @@ namespace poolqueue {
             occupier.then([=]() {
                   // If this is the last thread to decrement the
                   // counter then release all threads.
-                  if (--*count == 0)
+                  if (--*count == 0) {
+                     --syncing_;
                      promise->set_value();
+                  }
 
                   // Otherwise block here to guarantee that every
-                  // thread runs this lambda.
-                  else
+                  // thread runs this lambda. This is not a
+                  // long-running job for the watchdog.
+                  else {
+                     currentThread().worker_->started_.store(0, std::memory_order_relaxed);
                      future.wait();
+                  }
 
                   return nullptr;
                });
-            queue_.push(occupier);
+            ++pending_;
+            queue_.push(detail::Task(detail::SettlePromise{occupier}));
          }
          condition_.notify_all();
          
          return future;
       }
 
+      // Get a Promise for the pool becoming idle.
+      //
+      // The returned Promise fulfils (with an empty value) the next
+      // time there are no outstanding jobs, i.e. every job posted
+      // so far has completed, including callbacks that ran
+      // synchronously on settlement. It is settled immediately if
+      // the pool is already idle.
+      //
+      // Unlike synchronize(), this does not occupy any threads, so
+      // other work continues to flow, and it does not depend on the
+      // queue order.
+      //
+      // @return Promise that fulfils when the pool is idle.
+      Promise whenIdle() {
+         Promise p;
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            idle_.push_back(p);
+            idleWaiting_ = true;
+         }
+
+         // Either this thread sees the count at zero or the thread
+         // that brings it to zero sees idleWaiting_.
+         if (pending_ == 0)
+            settleIdle();
+         return p;
+      }
+
    private:
-      Q queue_;
+      typedef std::chrono::steady_clock Clock;
+
+      // Maximum number of jobs a thread retrieves from the queue at
+      // once.
+      static constexpr size_t BatchSize = 16;
+
+      // Maximum number of spare threads for blocking().
+      static constexpr unsigned int MaxSpares = 64;
+
+      // Maximum number of jobs a thread runs from its next slot
+      // before returning to the queue.
+      static constexpr unsigned int NextLimit = 3;
+
+      // Sampling interval for the queue wait metric, which needs an
+      // extra clock read when a job is posted.
+      static constexpr unsigned int WaitSampling = 8;
+
+      // Identifies the pool and index of a pool thread. This is
+      // thread-local, so lookup needs no synchronization with
+      // setThreadCount().
+      struct Worker;
+      struct Current {
+         const ThreadPoolT *pool_;
+         int index_;
+         Worker *worker_;
+      };
+
+      static Current& currentThread() {
+         static thread_local Current current = { nullptr, -1, nullptr };
+         return current;
+      }
+
+      struct Worker {
+         std::atomic<bool> running_;
+         std::atomic<bool> popping_;
+
+         // A job posted by this thread runs next on this thread,
+         // while its data is likely still in cache. Other threads
+         // only take it if they would otherwise sleep.
+         detail::SpinLock nextLock_;
+         detail::Task next_;
+
+         // Jobs retrieved but not yet run, only accessed by the
+         // worker thread.
+         detail::Task *batch_;
+         size_t batchNext_;
+         size_t batchEnd_;
+         size_t batchRequeued_;
+
+         // Start time of the current job when a watchdog is set,
+         // otherwise zero. reported_ is the start time of the last
+         // job passed to the watchdog callback, guarded by mutex_.
+         std::atomic<Clock::rep> started_;
+         Clock::rep reported_;
+
+         // Delayed jobs assigned to this thread. nextTimer_ is the
+         // earliest time, which idle threads read under mutex_ to
+         // compute their wait. A thread that adds an earlier job
+         // wakes them.
+         detail::SpinLock timerLock_;
+         detail::TimerHeap timers_;
+         std::atomic<Clock::rep> nextTimer_;
+
+#ifndef POOLQUEUE_NO_METRICS
+         detail::WorkerMetrics metrics_;
+#endif
 
+         Worker()
+            : running_(true)
+            , popping_(false)
+            , batch_(nullptr)
+            , batchNext_(0)
+            , batchEnd_(0)
+            , batchRequeued_(0)
+            , started_(0)
+            , reported_(0)
+            , nextTimer_(detail::TimerHeap::never()) {
+         }
+      };
+
+      typename Q::template rebind<detail::Task> queue_;
+
+      // Number of jobs posted but not yet completed.
+      std::atomic<size_t> pending_{0};
+      std::atomic<int> syncing_{0};
+
+      // Number of threads checking for or waiting for work under
+      // mutex_.
+      std::atomic<int> sleepers_{0};
+
+      // Capacity limit, guarded by mutex_ for blocked producers.
+      std::atomic<size_t> capacity_{0};
+      std::atomic<Overflow> overflow_{Overflow::Block};
+      std::atomic<int> blocked_{0};
+      std::condition_variable space_;
+
+      std::vector<Promise> idle_;
+      std::atomic<bool> idleWaiting_{false};
+
+      // Thread bookkeeping is guarded by mutex_, as threads may be
+      // added or removed by pool threads when auto-scaling.
       std::vector<std::thread> threads_;
-      std::deque<std::atomic<bool>> running_;
-      std::map<std::thread::id, int> ids_;
+      std::atomic<size_t> threadCount_{0};
+      std::deque<Worker> workers_;
+      std::vector<std::thread> retired_;
+      bool resizing_ = false;
+
+      // Next thread for delayed jobs from outside the pool.
+      size_t timerNext_ = 0;
+
+      // Set by the destructor, after which delayed jobs that are
+      // not yet due are dropped. Checked under timerLock_.
+      std::atomic<bool> discardTimers_{false};
+
+      // Threads currently in blocking(), and threads added to
+      // compensate for them.
+      unsigned int blocking_ = 0;
+      unsigned int spares_ = 0;
+      const std::vector<std::vector<int> > cpuSets_;
+
+      struct AutoScale {
+         unsigned int min_;
+         unsigned int max_;
+         Clock::duration idle_;
+      };
+      AutoScale autoScale_;
+      std::atomic<bool> autoScaling_{false};
+      std::atomic<Clock::rep> latency_{0};
+      std::atomic<Clock::rep> probeTime_{0};
+      std::atomic<bool> probing_{false};
       
+#ifndef POOLQUEUE_NO_METRICS
+      // Metrics totals from threads that have exited, guarded by
+      // mutex_.
+      struct Exited {
+         uint64_t jobs_ = 0;
+         uint64_t steals_ = 0;
+         detail::Histogram runTime_;
+         detail::Histogram queueWait_;
+      };
+      Exited exited_;
+#endif
+
+      // Treatment of jobs by runTask(); Drain runs them as usual.
+      std::atomic<Shutdown> stopping_{Shutdown::Drain};
+      std::once_flag shutdownOnce_;
+      std::thread shutdownThread_;
+      Promise shutdown_;
+
+      std::atomic<bool> watching_{false};
+      std::mutex watchdogMutex_;
+      std::condition_variable watchdogCondition_;
+      bool watchdogStop_ = false;
+      Clock::duration watchdogThreshold_;
+      std::function<void(int, Clock::duration)> watchdogCallback_;
+      std::thread watchdogThread_;
+
       std::mutex mutex_;
       std::condition_variable condition_;
 
       void setThreadCountImpl(unsigned int n) {
-         // Add threads.
+         // If no threads will remain then drain the queue first.
+         if (n == 0 && getThreadCount() > 0) {
+            std::promise<void> idle;
+            whenIdle().then([&]() {
+               idle.set_value();
+               return nullptr;
+            });
+            idle.get_future().wait();
+         }
+
+         std::unique_lock<std::mutex> lock(mutex_);
+         std::vector<std::thread> retired;
+         retired.swap(retired_);
+         spares_ = 0;
+
+         // Add threads. Running threads are not disturbed.
          const auto oldCount = threads_.size();
          if (n > oldCount) {
-            synchronize().wait();
-
-            // Use copy-and-swap for exception safety.
-            decltype(ids_) ids = ids_;
-            std::unique_lock<std::mutex> lock(mutex_);
             try {
-               for (size_t i = oldCount; i < n; ++i) {
-                  // Any of these statements can throw.
-                  running_.emplace_back(true);
-                  threads_.emplace_back(std::bind(&ThreadPoolT::run, this, i));
-                  ids[threads_.back().get_id()] = static_cast<int>(i);
-               }
-
-               ids_.swap(ids);
+               for (size_t i = oldCount; i < n; ++i)
+                  addThread();
             }
             catch (...) {
                // Tell newly launched threads to exit.
-               running_.resize(oldCount);
+               removeWorkers(oldCount);
 
                // Join any newly launched threads.
+               resizing_ = true;
                lock.unlock();
+               for (size_t i = oldCount; i < threads_.size(); ++i)
+                  threads_[i].join();
+               for (auto& t : retired)
+                  t.join();
+               lock.lock();
                threads_.resize(oldCount);
+               threadCount_ = oldCount;
+               resizing_ = false;
                throw;
             }
          }
 
-         // Remove threads.
+         // Remove threads. Removed threads exit after their current
+         // jobs, leaving queued jobs to the remaining threads.
          else if (n < oldCount) {
-            synchronize().wait();
-
-            // Separate threads to remove. A lock is not acquired because
-            // we assume no tasks are simultaneously posted.
+            // Separate threads to remove.
             std::vector<std::thread> remove(oldCount - n);
             std::move(threads_.begin() + n, threads_.end(), remove.begin());
             threads_.erase(threads_.begin() + n, threads_.end());
+            threadCount_ = n;
 
-            // Signal threads. Here we need the lock to make sure that
-            // all threads will test the condition.
-            {
-               std::lock_guard<std::mutex> lock(mutex_);
-               for (size_t i = 0; i < remove.size(); ++i)
-                  running_[n + i] = false;
-               condition_.notify_all();
-            }
+            // Signal threads. The lock makes sure that all threads
+            // will test the condition.
+            for (size_t i = 0; i < remove.size(); ++i)
+               workers_[n + i].running_ = false;
+            condition_.notify_all();
             
-            // Wait for removed threads to exit.
-            for (auto& t : remove) {
-               ids_.erase(t.get_id());
+            // Wait for removed threads to exit. Auto-scaling is
+            // suspended as workers_ is out of sync with threads_.
+            resizing_ = true;
+            lock.unlock();
+            for (auto& t : remove)
                t.join();
-            }
+            lock.lock();
+            resizing_ = false;
 
-            running_.resize(n);
+            // A removed thread may have consumed a notification meant
+            // for a job, so wake the remaining threads to check the
+            // queue.
+            removeWorkers(n);
+            condition_.notify_all();
          }
 
          assert(threads_.size() == n);
-         assert(running_.size() == n);
-         assert(std::all_of(running_.begin(), running_.end(), [](bool b) { return b; }));
-         assert(ids_.size() == n);
+         assert(workers_.size() == n);
+         assert(std::all_of(workers_.begin(), workers_.end(), [](const Worker& w) { return w.running_.load(); }));
+
+         lock.unlock();
+         for (auto& t : retired)
+            t.join();
       }
 
-      void enqueue(Promise& p) {
+      // Remove workers beyond the first n, keeping their metrics
+      // totals. mutex_ must be held.
+      void removeWorkers(size_t n) {
+         // Hand delayed jobs to the remaining threads.
+         bool moved = false;
+         for (size_t i = n; i < workers_.size(); ++i) {
+            auto& timers = workers_[i].timers_;
+            if (timers.size() == 0)
+               continue;
+            if (n == 0) {
+               pending_.fetch_sub(timers.size(), std::memory_order_relaxed);
+               continue;
+            }
+
+            Worker& worker = workers_[i % n];
+            std::lock_guard<detail::SpinLock> lock(worker.timerLock_);
+            worker.timers_.merge(timers);
+            worker.nextTimer_.store(worker.timers_.next(), std::memory_order_relaxed);
+            moved = true;
+         }
+         if (moved)
+            condition_.notify_all();
+
+#ifndef POOLQUEUE_NO_METRICS
+         for (size_t i = n; i < workers_.size(); ++i) {
+            const auto& w = workers_[i].metrics_;
+            exited_.jobs_ += w.jobs_.get();
+            exited_.steals_ += w.steals_.get();
+            detail::Histogram h;
+            detail::WorkerMetrics::get(w.runTime_, h);
+            exited_.runTime_ += h;
+            detail::WorkerMetrics::get(w.queueWait_, h);
+            exited_.queueWait_ += h;
+         }
+#endif
+         workers_.resize(n);
+      }
+
+      // Launch a thread. mutex_ must be held.
+      void addThread() {
+         const size_t i = threads_.size();
+         workers_.emplace_back();
+         try {
+            threads_.emplace_back(std::bind(&ThreadPoolT::run, this, i));
+         }
+         catch (...) {
+            workers_.pop_back();
+            throw;
+         }
+         threadCount_ = threads_.size();
+      }
+
+      // Measure queue latency with a probe job. A thread is added
+      // each time the outstanding probe exceeds the latency target,
+      // so growth does not wait for the backlog to drain.
+      void probe() {
+         if (pending_.load(std::memory_order_relaxed) <= threadCount_.load(std::memory_order_relaxed))
+            return;
+
+         const auto latency = latency_.load(std::memory_order_relaxed);
+         const auto now = Clock::now().time_since_epoch().count();
+         auto t = probeTime_.load(std::memory_order_relaxed);
+         if (now - t < latency)
+            return;
+
+         // Restarting the clock claims this latency period, so only
+         // one thread is added per period.
+         if (!probeTime_.compare_exchange_strong(t, now))
+            return;
+
+         // The outstanding probe is late.
+         if (probing_.load(std::memory_order_acquire))
+            grow();
+         else {
+            probing_ = true;
+            try {
+               enqueue(detail::Task([this]() {
+                  probeTime_.store(Clock::now().time_since_epoch().count(), std::memory_order_relaxed);
+                  probing_.store(false, std::memory_order_release);
+               }));
+            }
+            catch (...) {
+               // Try again next period.
+               probing_ = false;
+            }
+         }
+      }
+
+      void beginBlocking() {
+         // Return jobs this thread retrieved but has not run, so
+         // they aren't held up. That would break the ordering for
+         // synchronize() so it isn't done then.
+         Worker& worker = *currentThread().worker_;
+         if (worker.batchNext_ < worker.batchEnd_ && !syncing_) {
+            // A single push doesn't consume its argument if it
+            // throws, so on failure the remaining jobs stay here.
+            bool wasEmpty = false;
+            try {
+               while (worker.batchNext_ < worker.batchEnd_) {
+                  wasEmpty |= queue_.push(std::move(worker.batch_[worker.batchNext_]));
+                  ++worker.batchNext_;
+                  ++worker.batchRequeued_;
+               }
+            }
+            catch (...) {
+            }
+
+            std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+            if (wasEmpty)
+               lock.lock();
+            condition_.notify_all();
+         }
+         
+         std::vector<std::thread> retired;
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++blocking_;
+
+            // An idle thread can pick up work without a spare.
+            if (sleepers_ || spares_ >= MaxSpares || resizing_ || syncing_)
+               return;
+
+            try {
+               addThread();
+               ++spares_;
+            }
+            catch (...) {
+               // Run without a spare.
+            }
+            retired.swap(retired_);
+         }
+
+         for (auto& t : retired)
+            t.join();
+      }
+
+      void endBlocking() {
+         std::lock_guard<std::mutex> lock(mutex_);
+         --blocking_;
+
+         // Wake idle threads so a surplus spare can exit.
+         if (spares_ > blocking_)
+            condition_.notify_all();
+      }
+
+      // Add a thread for auto-scaling.
+      void grow() {
+         std::vector<std::thread> retired;
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!autoScaling_ || resizing_ || syncing_ || threads_.size() >= autoScale_.max_)
+               return;
+
+            try {
+               addThread();
+            }
+            catch (...) {
+               // Try again next period.
+            }
+            retired.swap(retired_);
+         }
+
+         for (auto& t : retired)
+            t.join();
+      }
+
+      // Remove the calling thread if it is a spare no longer needed
+      // for blocking(), or, after the idle timeout, for
+      // auto-scaling. mutex_ must be held. Returns true if the
+      // thread should exit.
+      bool retire(size_t i, bool timedOut) {
+         // Only the highest index thread exits, so indices remain
+         // contiguous.
+         if (resizing_ || syncing_ || i + 1 != threads_.size())
+            return false;
+         if (spares_ > blocking_)
+            --spares_;
+         else if (!timedOut || !autoScaling_ || threads_.size() <= autoScale_.min_)
+            return false;
+
+         // The thread can't join itself so leave that for later.
+         retired_.push_back(std::move(threads_.back()));
+         threads_.pop_back();
+         removeWorkers(workers_.size() - 1);
+         threadCount_ = threads_.size();
+         condition_.notify_one();
+         return true;
+      }
+
+      template<typename... K>
+      void enqueue(detail::Task&& task, const K&... key) {
          // If the queue was empty, we must take the lock to avoid the
          // race where all threads have found the queue empty but not
          // yet issued a wait.
@@ -303,28 +1311,563 @@ namespace poolqueue {
          // threads miss the notification (by being just before the
          // wait when the jobs are added). This may not be optimally
          // parallel but it should make progress.
+         stamp(task);
+         pending_.fetch_add(1, std::memory_order_relaxed);
+         try {
+            push(std::move(task), key...);
+         }
+         catch (...) {
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            throw;
+         }
+      }
+
+      // Queue a job already counted in pending_.
+      template<typename... K>
+      void push(detail::Task&& task, const K&... key) {
          std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
-         if (queue_.push(p))
+         if (queue_.push(std::move(task), key...) && Wait::Sleeps)
             lock.lock();
-         condition_.notify_one();
+         if (Wait::Sleeps)
+            condition_.notify_one();
+      }
+
+      // Enqueue a job, using the next slot if called from a pool
+      // thread.
+      void enqueueNext(detail::Task&& task) {
+         stamp(task);
+
+         // During synchronize() a job must queue behind the
+         // barrier rather than run next on this thread.
+         const Current& current = currentThread();
+         if (current.pool_ != this || syncing_.load()) {
+            enqueue(std::move(task));
+            return;
+         }
+
+         // Replace the slot contents. A displaced job moves to the
+         // queue, so the slot always holds the newest job.
+         Worker& worker = *current.worker_;
+         bool wasEmpty = false;
+         {
+            std::lock_guard<detail::SpinLock> lock(worker.nextLock_);
+            std::swap(task, worker.next_);
+            pending_.fetch_add(1, std::memory_order_relaxed);
+            if (task) {
+               try {
+                  wasEmpty = queue_.push(std::move(task));
+               }
+               catch (...) {
+                  std::swap(task, worker.next_);
+                  pending_.fetch_sub(1, std::memory_order_relaxed);
+                  throw;
+               }
+            }
+         }
+
+         // Wake a sleeping thread in case this one does not return
+         // to the slot promptly. The fence pairs with the one in
+         // run() so either this thread sees the sleeper or the
+         // sleeper sees the slot.
+         std::atomic_thread_fence(std::memory_order_seq_cst);
+         if (Wait::Sleeps && (wasEmpty || sleepers_.load(std::memory_order_relaxed))) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            condition_.notify_one();
+         }
+      }
+
+      // Add a delayed job.
+      void addTimer(Clock::time_point time, detail::Task&& task) {
+         const auto t = time.time_since_epoch().count();
+         pending_.fetch_add(1, std::memory_order_relaxed);
+         try {
+            // A pool thread keeps its own jobs and will see them
+            // before it next waits, but sleeping threads may be
+            // waiting for a later time. The fence pairs with the
+            // one in run() so either this thread sees the sleeper
+            // or the sleeper sees the new time.
+            const Current& current = currentThread();
+            if (current.pool_ == this) {
+               Worker& worker = *current.worker_;
+               if (!pushTimer(worker, t, std::move(task)))
+                  return;
+
+               std::atomic_thread_fence(std::memory_order_seq_cst);
+               if (Wait::Sleeps && sleepers_.load(std::memory_order_relaxed)) {
+                  std::lock_guard<std::mutex> lock(mutex_);
+                  condition_.notify_all();
+               }
+               return;
+            }
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (workers_.empty()) {
+               // The pool has shut down.
+               pending_.fetch_sub(1, std::memory_order_relaxed);
+               return;
+            }
+
+            // Threads may be waiting for a later time.
+            Worker& worker = workers_[timerNext_++ % workers_.size()];
+            if (pushTimer(worker, t, std::move(task)) && Wait::Sleeps)
+               condition_.notify_all();
+         }
+         catch (...) {
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            throw;
+         }
+      }
+
+      // Push a delayed job counted in pending_ to a thread's heap.
+      // Returns true if it is now that thread's earliest job.
+      bool pushTimer(Worker& worker, Clock::rep t, detail::Task&& task) {
+         std::lock_guard<detail::SpinLock> lock(worker.timerLock_);
+         if (discardTimers_.load(std::memory_order_relaxed) &&
+             t > Clock::now().time_since_epoch().count()) {
+            pending_.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+         }
+
+         if (!worker.timers_.push(t, std::move(task)))
+            return false;
+         worker.nextTimer_.store(t, std::memory_order_relaxed);
+         return true;
+      }
+
+      // Drop delayed jobs that are not yet due, and any added
+      // later.
+      void discardTimers() {
+         discardTimers_ = true;
+         size_t n = 0;
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            const auto now = Clock::now().time_since_epoch().count();
+            for (auto& worker : workers_) {
+               std::lock_guard<detail::SpinLock> timerLock(worker.timerLock_);
+               n += worker.timers_.discard(now);
+               worker.nextTimer_.store(worker.timers_.next(), std::memory_order_relaxed);
+            }
+         }
+         if (n)
+            complete(n);
+      }
+
+      // Get the earliest delayed job time of any thread, or
+      // never(). mutex_ must be held.
+      Clock::rep nextTimer() const {
+         auto next = detail::TimerHeap::never();
+         for (const auto& worker : workers_)
+            next = std::min(next, worker.nextTimer_.load(std::memory_order_relaxed));
+         return next;
+      }
+
+      // Check whether this thread has delayed jobs to run (or to
+      // discard on shutdown).
+      bool timersDue(const Worker& worker) const {
+         const auto next = worker.nextTimer_.load(std::memory_order_relaxed);
+         return next != detail::TimerHeap::never() &&
+            (stopping_.load(std::memory_order_relaxed) != Shutdown::Drain ||
+             next <= Clock::now().time_since_epoch().count());
+      }
+
+      // Run this thread's delayed jobs that are due.
+      void runTimers(Worker& worker) {
+         const auto due = stopping_.load(std::memory_order_relaxed) != Shutdown::Drain ?
+            detail::TimerHeap::never() :
+            Clock::now().time_since_epoch().count();
+         auto now = metricsNow();
+         for (;;) {
+            detail::Task task;
+            {
+               std::lock_guard<detail::SpinLock> lock(worker.timerLock_);
+               if (!worker.timers_.pop(due, task))
+                  return;
+               worker.nextTimer_.store(worker.timers_.next(), std::memory_order_relaxed);
+            }
+
+            runTask(worker, task, now);
+            complete(1);
+            runNext(worker, now);
+         }
+      }
+
+      // Take a due delayed job from any thread. mutex_ must be held.
+      bool stealTimer(detail::Task& task) {
+         bool haveTime = false;
+         Clock::rep now = 0;
+         for (auto& worker : workers_) {
+            const auto next = worker.nextTimer_.load(std::memory_order_relaxed);
+            if (next == detail::TimerHeap::never())
+               continue;
+            if (!haveTime) {
+               now = Clock::now().time_since_epoch().count();
+               haveTime = true;
+            }
+            if (next > now)
+               continue;
+
+            std::lock_guard<detail::SpinLock> lock(worker.timerLock_);
+            if (worker.timers_.pop(now, task)) {
+               worker.nextTimer_.store(worker.timers_.next(), std::memory_order_relaxed);
+               return true;
+            }
+         }
+         return false;
+      }
+
+      // Run jobs from this thread's next slot. After NextLimit jobs
+      // a remaining job is moved to the queue so that a chain of
+      // jobs posting jobs can't starve the queue. That is skipped
+      // during synchronize() because the job must run before the
+      // barrier.
+      void runNext(Worker& worker, Clock::time_point& now) {
+         for (unsigned int i = 0; ; ++i) {
+            detail::Task task;
+            {
+               std::lock_guard<detail::SpinLock> lock(worker.nextLock_);
+               std::swap(task, worker.next_);
+            }
+            if (!task)
+               return;
+
+            if (i >= NextLimit && !syncing_) {
+               try {
+                  push(std::move(task));
+                  return;
+               }
+               catch (...) {
+                  // Run it here instead.
+               }
+            }
+            
+            runTask(worker, task, now);
+            complete(1);
+         }
+      }
+
+      // Take a job from any thread's next slot. mutex_ must be
+      // held.
+      bool stealNext(detail::Task& task) {
+         for (auto& worker : workers_) {
+            std::lock_guard<detail::SpinLock> lock(worker.nextLock_);
+            if (worker.next_) {
+               std::swap(task, worker.next_);
+               return true;
+            }
+         }
+         return false;
+      }
+
+      template<typename Iterator>
+      void enqueue(Iterator bgn, Iterator end) {
+         // As with a single push, the lock is only required if the
+         // queue was empty. Wake only as many threads as there are
+         // new jobs.
+         const size_t n = std::distance(bgn, end);
+         std::unique_lock<std::mutex> lock(mutex_, std::defer_lock);
+         pending_.fetch_add(n, std::memory_order_relaxed);
+         bool wasEmpty;
+         try {
+            wasEmpty = queue_.push(bgn, end);
+         }
+         catch (...) {
+            pending_.fetch_sub(n, std::memory_order_relaxed);
+            throw;
+         }
+         if (!Wait::Sleeps)
+            return;
+         if (wasEmpty)
+            lock.lock();
+         if (n >= threadCount_.load(std::memory_order_relaxed))
+            condition_.notify_all();
+         else {
+            for (size_t i = 0; i < n; ++i)
+               condition_.notify_one();
+         }
+      }
+
+      void enqueuePromises(std::vector<Promise>& promises) {
+         if (!admit(promises.size())) {
+            for (auto& p : promises)
+               overflow(p);
+            return;
+         }
+         
+         std::vector<detail::Task> tasks;
+         tasks.reserve(promises.size());
+         for (const auto& p : promises) {
+            tasks.emplace_back(detail::SettlePromise{p});
+            stamp(tasks.back());
+         }
+         enqueue(std::make_move_iterator(tasks.begin()), std::make_move_iterator(tasks.end()));
+      }
+
+      // Retrieve a batch of jobs from the queue.
+      size_t pop(Worker& worker, detail::Task *batch) {
+         // The flag is set with sequential consistency so that either
+         // synchronize() sees it or this thread sees syncing_.
+         worker.popping_ = true;
+         // Jobs are retrieved singly from a keyed queue, as
+         // blocking() can't return the rest of a batch to it
+         // without their keys.
+         size_t n = 1;
+         if (!detail::HasKey<decltype(queue_)>::value && !syncing_) {
+            // Take no more than an even share of the pending jobs so
+            // one thread doesn't hoard work while others are idle.
+            // The count includes running jobs, which only makes the
+            // bound more conservative. The thread count can reach
+            // zero while threads being removed are still polling.
+            const size_t nThreads = threadCount_.load(std::memory_order_relaxed);
+            n = nThreads ? pending_.load(std::memory_order_relaxed)/nThreads : 1;
+            if (n > BatchSize)
+               n = BatchSize;
+            else if (n < 1)
+               n = 1;
+         }
+         n = queue_.pop(batch, n);
+         worker.popping_.store(false, std::memory_order_release);
+
+         if (n && autoScaling_.load(std::memory_order_relaxed))
+            probe();
+         return n;
+      }
+
+      // Account for completed jobs.
+      void complete(size_t n) {
+         const size_t remaining = pending_.fetch_sub(n) - n;
+         if (remaining == 0 && idleWaiting_)
+            settleIdle();
+
+         // Either this thread sees the blocked producer or the
+         // producer sees the new count.
+         if (blocked_.load() && remaining < capacity_.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(mutex_);
+            space_.notify_all();
+         }
+      }
+
+      bool hasSpace(size_t n) const {
+         const size_t capacity = capacity_.load(std::memory_order_relaxed);
+         const size_t depth = pending_.load();
+         return !capacity || !depth || depth + n <= capacity;
+      }
+      
+      // Check n new jobs against the capacity. Returns true if the
+      // jobs should be queued, or false if the overflow policy
+      // applies instead. This waits for space under the Block
+      // policy.
+      bool admit(size_t n) {
+         if (hasSpace(n))
+            return true;
+         if (overflow_ != Overflow::Block)
+            return false;
+         if (currentThread().pool_ == this)
+            return true;
+
+         std::unique_lock<std::mutex> lock(mutex_);
+         ++blocked_;
+         space_.wait(lock, [=]() { return hasSpace(n); });
+         --blocked_;
+         return true;
+      }
+
+      // Apply the overflow policy to a job that was not admitted.
+      void overflow(Promise& p) {
+         if (overflow_ == Overflow::CallerRuns)
+            p.settle();
+         else
+            p.settle(std::make_exception_ptr(std::length_error("ThreadPool is at capacity")));
+      }
+
+      void settleIdle() {
+         std::vector<Promise> idle;
+         {
+            std::lock_guard<std::mutex> lock(mutex_);
+            idle.swap(idle_);
+            idleWaiting_ = false;
+         }
+
+         for (auto& p : idle)
+            p.settle();
+      }
+
+      // Record the time a job is queued, for one in WaitSampling
+      // jobs posted by each thread.
+      static void stamp(detail::Task& task) {
+#ifndef POOLQUEUE_NO_METRICS
+         static thread_local unsigned int tick = 0;
+         if (++tick % WaitSampling == 0)
+            task.queued_ = Clock::now().time_since_epoch().count();
+#else
+         (void)task;
+#endif
+      }
+
+      // Get the current time for metrics.
+      static Clock::time_point metricsNow() {
+#ifndef POOLQUEUE_NO_METRICS
+         return Clock::now();
+#else
+         return Clock::time_point();
+#endif
+      }
+
+      // Run a job on a pool thread.
+      // @now Time the job starts, updated to the time it ends.
+      //
+      // Consecutive jobs pass the end time of one as the start of
+      // the next to save reading the clock, so run times include
+      // the bookkeeping between jobs.
+      void runTask(Worker& worker, detail::Task& task, Clock::time_point& now) {
+         const Shutdown stopping = stopping_.load(std::memory_order_relaxed);
+         if (stopping != Shutdown::Drain) {
+            if (stopping == Shutdown::Cancel)
+               task.cancel(std::make_exception_ptr(job_cancelled()));
+            else
+               task = detail::Task();
+            return;
+         }
+
+         // Clear the start time afterwards even if the watchdog is
+         // removed meanwhile, so a later watchdog isn't misled.
+         struct Watch {
+            std::atomic<Clock::rep> *started_;
+            ~Watch() {
+               if (started_)
+                  started_->store(0, std::memory_order_relaxed);
+            }
+         } watch = { nullptr };
+         if (watching_.load(std::memory_order_relaxed)) {
+#ifdef POOLQUEUE_NO_METRICS
+            now = Clock::now();
+#endif
+            worker.started_.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+            watch.started_ = &worker.started_;
+         }
+
+#ifndef POOLQUEUE_NO_METRICS
+         auto& metrics = worker.metrics_;
+         const auto t0 = now;
+         if (task.queued_) {
+            const Clock::duration wait(t0.time_since_epoch().count() - task.queued_);
+            metrics.queueWait_[detail::Histogram::bucket(wait)].add(1);
+         }
+         task.run();
+         now = Clock::now();
+         const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(now - t0);
+         metrics.runTime_[detail::Histogram::bucket(elapsed)].add(1);
+         metrics.busy_.add(elapsed.count());
+         metrics.jobs_.add(1);
+#else
+         (void)worker;
+         (void)now;
+         task.run();
+#endif
+      }
+
+      // Switch runTask() to discard jobs, and wake threads waiting
+      // for delayed jobs to discard those too.
+      void setStopping(Shutdown mode) {
+         std::lock_guard<std::mutex> lock(mutex_);
+         stopping_ = mode;
+         condition_.notify_all();
+      }
+
+      // Shutdown thread.
+      void stop(Clock::time_point deadline) {
+         clearAutoScale();
+         if (stopping_ == Shutdown::Drain)
+            discardTimers();
+
+         // Wait for the queue to drain until the deadline.
+         if (stopping_ == Shutdown::Drain && deadline != Clock::time_point::max()) {
+            auto idle = std::make_shared<std::promise<void> >();
+            whenIdle().then([=]() {
+               idle->set_value();
+               return nullptr;
+            });
+            if (idle->get_future().wait_until(deadline) == std::future_status::timeout)
+               setStopping(Shutdown::Cancel);
+         }
+
+         setThreadCountImpl(0);
+         shutdown_.settle();
+      }
+
+      // Watchdog thread.
+      void watch() {
+         std::unique_lock<std::mutex> lock(watchdogMutex_);
+         const auto threshold = watchdogThreshold_;
+         const auto period = std::max(threshold/2, Clock::duration(std::chrono::milliseconds(1)));
+         while (!watchdogCondition_.wait_for(lock, period, [this]() { return watchdogStop_; })) {
+            lock.unlock();
+            std::vector<std::pair<int, Clock::duration> > late;
+            {
+               std::lock_guard<std::mutex> poolLock(mutex_);
+               const auto now = Clock::now().time_since_epoch().count();
+               for (size_t i = 0; i < workers_.size(); ++i) {
+                  Worker& worker = workers_[i];
+                  const auto started = worker.started_.load(std::memory_order_relaxed);
+                  if (started && started != worker.reported_ && now - started > threshold.count()) {
+                     worker.reported_ = started;
+                     late.emplace_back(static_cast<int>(i), Clock::duration(now - started));
+                  }
+               }
+            }
+
+            // The callback is not replaced until this thread exits.
+            for (const auto& job : late)
+               watchdogCallback_(job.first, job.second);
+            lock.lock();
+         }
       }
 
       void run(size_t i) {
+         Worker *w;
          {
             // Exit cleanly if anything in start up failed.
             std::lock_guard<std::mutex> lock(mutex_);
-            if (i >= running_.size())
+            if (i >= workers_.size())
                return;
+            w = &workers_[i];
          }
          
-         auto& running = running_[i];
-         poolqueue::Promise p;
-         while (running) {
-            // Attempt to run the next task from the queue.
-            if (queue_.pop(p)) {
-               p.settle();
+         currentThread() = { this, static_cast<int>(i), w };
+         if (!cpuSets_.empty())
+            detail::setThreadAffinity(cpuSets_[i % cpuSets_.size()]);
+         auto& worker = *w;
+         detail::Task batch[BatchSize];
+         unsigned int polls = 0;
+
+         // Start of the current idle period for a thread that
+         // doesn't sleep, or zero if it has found work since.
+         Clock::time_point idleSince;
+         while (worker.running_) {
+            if (timersDue(worker))
+               runTimers(worker);
+
+            // Attempt to run the next tasks from the queue.
+            if (const size_t n = pop(worker, batch)) {
+               // blocking() may hand the rest of the batch back to
+               // the queue.
+               worker.batch_ = batch;
+               worker.batchEnd_ = n;
+               worker.batchRequeued_ = 0;
+               auto now = metricsNow();
+               for (worker.batchNext_ = 0; worker.batchNext_ < n; ) {
+                  runTask(worker, batch[worker.batchNext_++], now);
+                  runNext(worker, now);
+               }
+               complete(n - worker.batchRequeued_);
+               polls = 0;
+               idleSince = Clock::time_point();
+            }
+            else if (Wait::spin(polls++)) {
+               // Poll again.
             }
             else {
+               polls = 0;
+
                // The queue was empty so we will wait
                // for a condition notification, which
                // requires a lock.
@@ -333,16 +1876,88 @@ namespace poolqueue {
                // Check the queue in case an item was
                // added and the notification fired
                // before the lock was acquired.
-               if (queue_.pop(p)) {
+               if (queue_.pop(batch[0])) {
                   // Don't call user code with the lock.
                   lock.unlock();
-                  p.settle();
+                  idleSince = Clock::time_point();
+                  auto now = metricsNow();
+                  runTask(worker, batch[0], now);
+                  complete(1);
+                  runNext(worker, now);
+                  continue;
+               }
+
+               // Rather than sleep, take a job waiting in another
+               // thread's next slot. The fence pairs with the one
+               // in enqueueNext().
+               ++sleepers_;
+               std::atomic_thread_fence(std::memory_order_seq_cst);
+               if (stealNext(batch[0])) {
+                  --sleepers_;
+                  lock.unlock();
+#ifndef POOLQUEUE_NO_METRICS
+                  worker.metrics_.steals_.add(1);
+#endif
+                  idleSince = Clock::time_point();
+                  auto now = metricsNow();
+                  runTask(worker, batch[0], now);
+                  complete(1);
+                  runNext(worker, now);
+                  continue;
+               }
+
+               // Likewise a due delayed job.
+               if (stealTimer(batch[0])) {
+                  --sleepers_;
+                  lock.unlock();
+                  idleSince = Clock::time_point();
+                  auto now = metricsNow();
+                  runTask(worker, batch[0], now);
+                  complete(1);
+                  runNext(worker, now);
+                  continue;
                }
 
                // The queue is now known to be empty.
-               else if (running) {
-                  condition_.wait(lock);
+               bool retired = false;
+               if (worker.running_) {
+#ifndef POOLQUEUE_NO_METRICS
+                  const auto t0 = Clock::now();
+#endif
+                  const auto next = nextTimer();
+                  if (retire(i, false))
+                     retired = true;
+                  else if (!Wait::Sleeps) {
+                     // There is no timed wait, so a thread that has
+                     // been idle for the auto-scaling period retires
+                     // here instead.
+                     const auto now = Clock::now();
+                     if (idleSince == Clock::time_point())
+                        idleSince = now;
+                     else if (autoScaling_ && next == detail::TimerHeap::never() &&
+                              now - idleSince >= autoScale_.idle_)
+                        retired = retire(i, true);
+                     if (!retired)
+                        lock.unlock();
+                  }
+                  else if (timersDue(worker))
+                     lock.unlock();
+                  else if (next != detail::TimerHeap::never())
+                     condition_.wait_until(lock, Clock::time_point(Clock::duration(next)));
+                  else if (!autoScaling_)
+                     condition_.wait(lock);
+                  else if (condition_.wait_for(lock, autoScale_.idle_) == std::cv_status::timeout)
+                     retired = retire(i, true);
+#ifndef POOLQUEUE_NO_METRICS
+                  if (!retired)
+                     worker.metrics_.park_.add(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count());
+#endif
                }
+               --sleepers_;
+
+               // The Worker instance has been destroyed.
+               if (retired)
+                  return;
             }
          }
       }
@@ -18,6 +18,476 @@ namespace poolqueue {
    namespace detail {
 
       constexpr size_t CacheLineSize = 64;
+
+      // Padding that rounds an object of the given size up to whole
+      // cache lines. It is used as the first base class so that an
+      // exact fit costs nothing, as an empty base takes no space.
+      template<size_t Size, size_t Remainder = Size % CacheLineSize>
+      struct CacheLinePad {
+         char pad[CacheLineSize - Remainder];
+      };
+
+      template<size_t Size>
+      struct CacheLinePad<Size, 0> {
+      };
+
+      // Adapt a function taking an index to a nullary function,
+      // e.g. for ThreadPoolT::postN().
+      template<typename F>
+      struct IndexedCall {
+         typedef typename CallableTraits<F>::ResultType Result;
+
+         F f_;
+         size_t i_;
+
+         IndexedCall(const F& f, size_t i)
+            : f_(f)
+            , i_(i) {
+         }
+
+         Result operator()() const {
+            return f_(i_);
+         }
+      };
+      
+      // Test whether a queue class takes a key in push(), which it
+      // declares with a Key member type.
+      template<typename T>
+      struct Void {
+         typedef void type;
+      };
+
+      template<typename Q, typename = void>
+      struct HasKey : std::false_type {};
+
+      template<typename Q>
+      struct HasKey<Q, typename Void<typename Q::Key>::type> : std::true_type {};
+
+      // Called when a Task is cancelled instead of run. Callables
+      // that own a Promise provide an overload (found by
+      // argument-dependent lookup) that rejects it.
+      template<typename F>
+      void cancelTask(F&, const std::exception_ptr&) {
+      }
+
+      // Type-erased nullary job, the element type of ThreadPoolT
+      // queues. A callable that fits in the small buffer (and can
+      // be moved without throwing) is stored inline, so a job costs
+      // no allocation beyond its queue node. Larger callables are
+      // stored on the heap. Any result is discarded.
+      class Task {
+      public:
+         static constexpr size_t BufferSize = 5*sizeof(void *);
+         
+         Task() noexcept
+            : ops_(nullptr) {
+         }
+
+         template<typename F, typename = typename std::enable_if<
+                                 !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+         explicit Task(F&& f)
+            : ops_(nullptr) {
+            typedef Storage<typename std::decay<F>::type> S;
+            S::create(&buffer_, std::forward<F>(f));
+            ops_ = S::ops();
+         }
+
+         Task(Task&& other) noexcept
+            : ops_(nullptr) {
+            *this = std::move(other);
+         }
+
+         Task& operator=(Task&& other) noexcept {
+            if (this != &other) {
+               reset();
+               if (other.ops_) {
+                  other.ops_->move(&buffer_, &other.buffer_);
+                  std::swap(ops_, other.ops_);
+               }
+#ifndef POOLQUEUE_NO_METRICS
+               queued_ = other.queued_;
+#endif
+            }
+            return *this;
+         }
+
+         ~Task() {
+            reset();
+         }
+
+         explicit operator bool() const noexcept {
+            return ops_ != nullptr;
+         }
+
+         // Invoke and release the function. A Task runs at most
+         // once. An exception escaping the function calls
+         // std::terminate().
+         void run() noexcept {
+            const Ops *ops = ops_;
+            ops_ = nullptr;
+            ops->run(&buffer_);
+         }
+
+         // Release the function without invoking it. If it would
+         // settle a Promise, the Promise rejects with e instead.
+         void cancel(const std::exception_ptr& e) noexcept {
+            const Ops *ops = ops_;
+            ops_ = nullptr;
+            ops->cancel(&buffer_, e);
+         }
+
+#ifndef POOLQUEUE_NO_METRICS
+         // steady_clock time when the task was queued, or zero if not
+         // recorded, for ThreadPoolT metrics.
+         std::chrono::steady_clock::rep queued_ = 0;
+#endif
+
+      private:
+         struct Ops {
+            void (*run)(void *);
+            void (*cancel)(void *, const std::exception_ptr&);
+            void (*move)(void *, void *);
+            void (*destroy)(void *);
+         };
+
+         typedef std::aligned_storage<BufferSize, alignof(void *)>::type Buffer;
+         
+         template<typename F,
+                  bool Inline = sizeof(F) <= sizeof(Buffer) &&
+                                alignof(F) <= alignof(Buffer) &&
+                                std::is_nothrow_move_constructible<F>::value>
+         struct Storage {
+            static F *get(void *p) {
+               return static_cast<F *>(p);
+            }
+
+            template<typename X>
+            static void create(void *p, X&& f) {
+               new (p) F(std::forward<X>(f));
+            }
+
+            static void run(void *p) {
+               F *f = get(p);
+               struct Destroy {
+                  F *f_;
+                  ~Destroy() { f_->~F(); }
+               } destroy = { f };
+               (*f)();
+            }
+
+            static void cancel(void *p, const std::exception_ptr& e) {
+               F *f = get(p);
+               struct Destroy {
+                  F *f_;
+                  ~Destroy() { f_->~F(); }
+               } destroy = { f };
+               cancelTask(*f, e);
+            }
+
+            static void move(void *dst, void *src) {
+               new (dst) F(std::move(*get(src)));
+               get(src)->~F();
+            }
+
+            static void destroy(void *p) {
+               get(p)->~F();
+            }
+
+            static const Ops *ops() {
+               static const Ops table = { &run, &cancel, &move, &destroy };
+               return &table;
+            }
+         };
+
+         template<typename F>
+         struct Storage<F, false> {
+            static F *& get(void *p) {
+               return *static_cast<F **>(p);
+            }
+
+            template<typename X>
+            static void create(void *p, X&& f) {
+               get(p) = new F(std::forward<X>(f));
+            }
+
+            static void run(void *p) {
+               std::unique_ptr<F> f(get(p));
+               (*f)();
+            }
+
+            static void cancel(void *p, const std::exception_ptr& e) {
+               std::unique_ptr<F> f(get(p));
+               cancelTask(*f, e);
+            }
+
+            static void move(void *dst, void *src) {
+               get(dst) = get(src);
+            }
+
+            static void destroy(void *p) {
+               delete get(p);
+            }
+
+            static const Ops *ops() {
+               static const Ops table = { &run, &cancel, &move, &destroy };
+               return &table;
+            }
+         };
+
+         void reset() noexcept {
+            if (ops_) {
+               ops_->destroy(&buffer_);
+               ops_ = nullptr;
+            }
+         }
+
+         Buffer buffer_;
+         const Ops *ops_;
+      };
+
+      // Histogram of durations with power-of-two buckets. Bucket i
+      // counts durations of at least 2^i nanoseconds (except bucket
+      // 0, which includes zero) and less than 2^(i+1) nanoseconds,
+      // and the last bucket also counts anything longer.
+      struct Histogram {
+         static constexpr size_t Buckets = 40;
+
+         uint64_t counts[Buckets];
+
+         Histogram() {
+            std::fill(counts, counts + Buckets, 0);
+         }
+
+         static size_t bucket(std::chrono::nanoseconds d) {
+            uint64_t ns = d.count() > 0 ? d.count() : 0;
+            size_t i = 0;
+            while (ns >>= 1)
+               ++i;
+            return std::min(i, Buckets - 1);
+         }
+
+         // Get the total count.
+         uint64_t count() const {
+            uint64_t n = 0;
+            for (auto c : counts)
+               n += c;
+            return n;
+         }
+
+         // Get an upper bound for a quantile, e.g. 0.99, or zero if
+         // the histogram is empty.
+         std::chrono::nanoseconds quantile(double q) const {
+            const uint64_t total = count();
+            uint64_t n = 0;
+            for (size_t i = 0; i < Buckets; ++i) {
+               n += counts[i];
+               if (n && n >= q*total)
+                  return std::chrono::nanoseconds(uint64_t(2) << i);
+            }
+            return std::chrono::nanoseconds(0);
+         }
+
+         Histogram& operator+=(const Histogram& other) {
+            for (size_t i = 0; i < Buckets; ++i)
+               counts[i] += other.counts[i];
+            return *this;
+         }
+      };
+
+#ifndef POOLQUEUE_NO_METRICS
+      // Counters for a single thread. Only the owning thread
+      // writes, so updates need no atomic read-modify-write, but
+      // other threads may read at any time.
+      struct WorkerMetrics {
+         struct Counter {
+            std::atomic<uint64_t> value_{0};
+
+            void add(uint64_t n) {
+               value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+
+            uint64_t get() const {
+               return value_.load(std::memory_order_relaxed);
+            }
+         };
+
+         std::chrono::steady_clock::time_point start_;
+         Counter jobs_;
+         Counter steals_;
+         Counter busy_;
+         Counter park_;
+         Counter runTime_[Histogram::Buckets];
+         Counter queueWait_[Histogram::Buckets];
+
+         WorkerMetrics()
+            : start_(std::chrono::steady_clock::now()) {
+         }
+
+         static void get(const Counter *counters, Histogram& h) {
+            for (size_t i = 0; i < Histogram::Buckets; ++i)
+               h.counts[i] = counters[i].get();
+         }
+      };
+#endif
+
+      // Task callable that settles a Promise.
+      struct SettlePromise {
+         Promise promise_;
+
+         void operator()() const {
+            promise_.settle();
+         }
+      };
+
+      inline void cancelTask(SettlePromise& f, const std::exception_ptr& e) {
+         f.promise_.settle(e);
+      }
+
+      // Exception for a job cancelled by ThreadPoolT::shutdown().
+      struct job_cancelled : public std::runtime_error {
+         job_cancelled()
+            : std::runtime_error("job cancelled") {
+         }
+      };
+
+      // Tasks ordered by steady_clock time (earliest first), for
+      // ThreadPoolT::postAt(). Tasks with equal times are popped in
+      // the order pushed. Not thread-safe.
+      class TimerHeap {
+      public:
+         typedef std::chrono::steady_clock::rep Time;
+
+         // Time of an empty heap.
+         static constexpr Time never() {
+            return std::chrono::steady_clock::duration::max().count();
+         }
+
+         // @return true if the task is now the earliest.
+         bool push(Time time, Task&& task) {
+            const uint64_t sequence = sequence_++;
+            heap_.push_back(Entry{ time, sequence, std::move(task) });
+            std::push_heap(heap_.begin(), heap_.end(), Later());
+            return heap_.front().sequence_ == sequence;
+         }
+
+         // Pop the earliest task if it is due.
+         // @now Current time.
+         //
+         // @return true if a task was popped.
+         bool pop(Time now, Task& task) {
+            if (heap_.empty() || heap_.front().time_ > now)
+               return false;
+            std::pop_heap(heap_.begin(), heap_.end(), Later());
+            task = std::move(heap_.back().task_);
+            heap_.pop_back();
+            return true;
+         }
+
+         // Move all tasks from another heap.
+         void merge(TimerHeap& other) {
+            for (auto& entry : other.heap_)
+               push(entry.time_, std::move(entry.task_));
+            other.heap_.clear();
+         }
+
+         // Discard tasks that are not yet due.
+         // @now Current time.
+         //
+         // @return Number of tasks discarded.
+         size_t discard(Time now) {
+            const auto later = std::partition(heap_.begin(), heap_.end(), [=](const Entry& e) {
+               return e.time_ <= now;
+            });
+            const size_t n = heap_.end() - later;
+            heap_.erase(later, heap_.end());
+            std::make_heap(heap_.begin(), heap_.end(), Later());
+            return n;
+         }
+
+         // Time of the earliest task, or never().
+         Time next() const {
+            return heap_.empty() ? never() : heap_.front().time_;
+         }
+
+         size_t size() const {
+            return heap_.size();
+         }
+
+      private:
+         struct Entry {
+            Time time_;
+            uint64_t sequence_;
+            Task task_;
+         };
+
+         struct Later {
+            bool operator()(const Entry& a, const Entry& b) const {
+               return a.time_ > b.time_ || (a.time_ == b.time_ && a.sequence_ > b.sequence_);
+            }
+         };
+
+         std::vector<Entry> heap_;
+         uint64_t sequence_ = 0;
+      };
+
+      // Group the CPUs available to this process, either by physical
+      // core (hyperthreads share a group) or by socket, using the
+      // Linux /sys topology. Groups are ordered by their first CPU.
+      // On other platforms, or if the topology is unavailable, the
+      // result is empty.
+      inline std::vector<std::vector<int> > cpuGroups(bool bySocket) {
+         std::map<std::pair<int, int>, std::vector<int> > groups;
+#ifdef __linux__
+         cpu_set_t available;
+         if (sched_getaffinity(0, sizeof(available), &available) != 0)
+            return std::vector<std::vector<int> >();
+         
+         auto readId = [](int cpu, const char *name) {
+            std::ifstream f("/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/" + name);
+            int id;
+            return (f >> id) ? id : -1;
+         };
+
+         for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (!CPU_ISSET(cpu, &available))
+               continue;
+
+            // Without topology each CPU is its own core on one socket.
+            const int socket = std::max(readId(cpu, "physical_package_id"), 0);
+            int core = bySocket ? 0 : readId(cpu, "core_id");
+            if (core < 0)
+               core = cpu;
+            groups[std::make_pair(socket, core)].push_back(cpu);
+         }
+#else
+         (void)bySocket;
+#endif
+         std::vector<std::vector<int> > result;
+         for (auto& group : groups)
+            result.push_back(std::move(group.second));
+         std::sort(result.begin(), result.end());
+         return result;
+      }
+
+      // Restrict the calling thread to a set of CPUs. This is
+      // best effort; an unsupported platform or an invalid set
+      // leaves the thread unrestricted.
+      inline void setThreadAffinity(const std::vector<int>& cpus) {
+#ifdef __linux__
+         if (cpus.empty())
+            return;
+         
+         cpu_set_t set;
+         CPU_ZERO(&set);
+         for (int cpu : cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE)
+               CPU_SET(cpu, &set);
+         }
+         pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+         (void)cpus;
+#endif
+      }
       
       struct SpinLock {
          std::atomic<bool> locked_;
@@ -36,6 +506,68 @@ namespace poolqueue {
             locked_.store(false, std::memory_order_release);;
          }
       };
+
+      // Hint to the processor that this is a spin-wait loop.
+      inline void cpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+         __builtin_ia32_pause();
+#elif defined(__aarch64__)
+         asm volatile("yield");
+#endif
+      }
+
+      // Wait policies for idle ThreadPoolT threads. A policy is a
+      // class with:
+      //
+      //   static const bool Sleeps;
+      //   static bool spin(unsigned int n);
+      //
+      // spin() is called after the nth consecutive failed poll of
+      // the queue and returns true to poll again. When it returns
+      // false the thread checks the other threads' next slots and,
+      // if Sleeps, waits for a notification. If not Sleeps the
+      // thread never waits, so posting skips notifications.
+
+      // Wait for a notification as soon as the queue is empty.
+      struct Blocking {
+         static const bool Sleeps = true;
+
+         static bool spin(unsigned int) {
+            return false;
+         }
+      };
+
+      // Spin briefly, then yield the processor, then wait.
+      struct SpinYield {
+         static const bool Sleeps = true;
+         static const unsigned int SpinLimit = 64;
+         static const unsigned int YieldLimit = 64;
+
+         static bool spin(unsigned int n) {
+            if (n < SpinLimit)
+               cpuRelax();
+            else if (n < SpinLimit + YieldLimit)
+               std::this_thread::yield();
+            else
+               return false;
+            return true;
+         }
+      };
+
+      // Poll continuously. Idle threads keep their processors busy,
+      // which minimizes latency only when threads have dedicated
+      // cores.
+      struct BusySpin {
+         static const bool Sleeps = false;
+
+         // Polls between checks of the next slots.
+         static const unsigned int PollLimit = 1024;
+
+         static bool spin(unsigned int n) {
+            cpuRelax();
+            return n + 1 < PollLimit;
+         }
+      };
       
       // This concurrent queue follows "Simple, Fast, and Practical
       // Non-Blocking and Blocking Concurrent Queue Algorithms" by
@@ -47,7 +579,16 @@ namespace poolqueue {
       // minimizing state contention with consumers.
       template<typename T>
       struct ConcurrentQueue {
-         struct Node {
+         template<typename U>
+         using rebind = ConcurrentQueue<U>;
+
+         struct Node;
+         struct NodeLayout {
+            T value_;
+            std::atomic<Node *> next_;
+         };
+
+         struct Node : CacheLinePad<sizeof(NodeLayout)> {
             template<typename V>
             Node(V&& value)
                : value_(std::forward<V>(value))
@@ -58,8 +599,8 @@ namespace poolqueue {
          
             T value_;
             std::atomic<Node *> next_;
-            char pad[CacheLineSize - sizeof(T) - sizeof(std::atomic<Node *>)];
          };
+         static_assert(sizeof(Node) % CacheLineSize == 0, "Node must fill whole cache lines");
 
          ConcurrentQueue() {
             head_ = tail_ = new Node(T());
@@ -88,6 +629,39 @@ namespace poolqueue {
             return wasEmpty;
          }
 
+         // Append a range of values to the tail of the queue. The
+         // nodes are linked before the lock is taken so the whole
+         // chain is spliced with a single exchange. Returns true if
+         // the queue was empty before the operation.
+         template<typename Iterator>
+         bool push(Iterator bgn, Iterator end) {
+            if (bgn == end)
+               return false;
+
+            Node *first = new Node(*bgn);
+            Node *last = first;
+            try {
+               for (auto i = ++bgn; i != end; ++i) {
+                  Node *node = new Node(*i);
+                  last->next_.store(node, std::memory_order_relaxed);
+                  last = node;
+               }
+            }
+            catch (...) {
+               while (first) {
+                  Node *node = first;
+                  first = node->next_.load(std::memory_order_relaxed);
+                  delete node;
+               }
+               throw;
+            }
+
+            std::lock_guard<SpinLock> lock(tailLock_);
+            const bool wasEmpty = tail_->next_.exchange(first);
+            tail_ = last;
+            return wasEmpty;
+         }
+
          // Retrieve a value from the head of the queue into the
          // reference argument. Returns true if successful, i.e. if the
          // queue was not empty.
@@ -114,6 +688,39 @@ namespace poolqueue {
             }
          }
 
+         // Retrieve up to n values from the head of the queue into
+         // the array argument with a single lock acquisition. Returns
+         // the number of values retrieved.
+         size_t pop(T *results, size_t n) {
+            using std::swap;
+            std::unique_lock<SpinLock> lock(headLock_);
+
+            Node *oldHead = head_;
+            size_t count = 0;
+            while (count < n) {
+               Node *next = head_->next_;
+               if (!next || next == head_)
+                  break;
+               swap(results[count++], next->value_);
+               head_ = next;
+            }
+
+            if (count) {
+               // Head points to self when empty.
+               Node *newHead = head_;
+               Node *null = nullptr;
+               newHead->next_.compare_exchange_strong(null, newHead);
+
+               lock.unlock();
+               while (oldHead != newHead) {
+                  Node *node = oldHead;
+                  oldHead = node->next_.load(std::memory_order_relaxed);
+                  delete node;
+               }
+            }
+            return count;
+         }
+
          // Attempt to put each member variable on its own cache line.
          char pad[CacheLineSize];
          SpinLock headLock_;
@@ -130,7 +737,16 @@ namespace poolqueue {
 
       template<typename T>
       struct ConcurrentStack {
-         struct Node {
+         template<typename U>
+         using rebind = ConcurrentStack<U>;
+
+         struct Node;
+         struct NodeLayout {
+            T value_;
+            Node *next_;
+         };
+
+         struct Node : CacheLinePad<sizeof(NodeLayout)> {
             template<typename V>
             Node(V&& value)
                : value_(std::forward<V>(value))
@@ -141,8 +757,8 @@ namespace poolqueue {
          
             T value_;
             Node * next_;
-            char pad[CacheLineSize - sizeof(T) - sizeof(std::atomic<Node *>)];
          };
+         static_assert(sizeof(Node) % CacheLineSize == 0, "Node must fill whole cache lines");
 
          ConcurrentStack()
             : head_(nullptr) {
@@ -167,6 +783,39 @@ namespace poolqueue {
             return !node->next_;
          }
 
+         // Prepend a range of values to the head of the queue. The
+         // last value in the range ends up on top, as if each value
+         // had been pushed individually. Returns true if the queue
+         // was empty before the operation.
+         template<typename Iterator>
+         bool push(Iterator bgn, Iterator end) {
+            if (bgn == end)
+               return false;
+
+            Node *bottom = new Node(*bgn);
+            Node *top = bottom;
+            try {
+               for (auto i = ++bgn; i != end; ++i) {
+                  Node *node = new Node(*i);
+                  node->next_ = top;
+                  top = node;
+               }
+            }
+            catch (...) {
+               while (top) {
+                  Node *node = top;
+                  top = node->next_;
+                  delete node;
+               }
+               throw;
+            }
+
+            std::lock_guard<SpinLock> lock(headLock_);
+            bottom->next_ = head_;
+            head_ = top;
+            return !bottom->next_;
+         }
+
          // Retrieve a value from the head of the queue into the
          // reference argument. Returns true if successful, i.e. if the
          // queue was not empty.
@@ -185,6 +834,30 @@ namespace poolqueue {
             return false;
          }
 
+         // Retrieve up to n values from the head of the queue into
+         // the array argument with a single lock acquisition. Returns
+         // the number of values retrieved.
+         size_t pop(T *results, size_t n) {
+            using std::swap;
+            std::unique_lock<SpinLock> lock(headLock_);
+
+            Node *oldHead = head_;
+            size_t count = 0;
+            while (count < n && head_) {
+               swap(results[count++], head_->value_);
+               head_ = head_->next_;
+            }
+            Node *newHead = head_;
+
+            lock.unlock();
+            while (oldHead != newHead) {
+               Node *node = oldHead;
+               oldHead = node->next_;
+               delete node;
+            }
+            return count;
+         }
+
          // Attempt to put each member variable on its own cache line.
          char pad[CacheLineSize];
          SpinLock headLock_;
@@ -194,5 +867,743 @@ namespace poolqueue {
          };
       };
 
+      // Lock-free LIFO stack (Treiber stack).
+      //
+      // The head is a single 64-bit word holding a 32-bit node index
+      // and a 32-bit tag that changes on every update, so a
+      // compare-and-swap fails if the head was popped and pushed
+      // again in between (the ABA problem) without needing a wider
+      // atomic. A popped node is not freed but goes to a free list,
+      // itself a tagged stack, so a thread that read a stale head
+      // still reads valid (if outdated) memory. Nodes are allocated
+      // in chunks that double in size, so an index maps to a node
+      // with a little arithmetic and no lock; only adding a chunk
+      // takes a lock. Memory is released when the stack is
+      // destroyed.
+      template<typename T>
+      struct LockFreeStack {
+         template<typename U>
+         using rebind = LockFreeStack<U>;
+
+         LockFreeStack()
+            : head_(Empty)
+            , free_(Empty)
+            , chunkCount_(0) {
+            for (auto& chunk : chunks_)
+               chunk.store(nullptr, std::memory_order_relaxed);
+         }
+
+         LockFreeStack(const LockFreeStack&) = delete;
+         LockFreeStack& operator=(const LockFreeStack&) = delete;
+
+         ~LockFreeStack() {
+            for (uint32_t i = index(head_.load()); i != Null; i = node(i).next_.load())
+               node(i).value()->~T();
+            for (auto& chunk : chunks_)
+               delete[] chunk.load();
+         }
+
+         // Prepend a new value to the head of the stack. Returns true
+         // if the stack was empty before the operation.
+         template<typename X>
+         bool push(X&& value) {
+            const uint32_t i = allocate();
+            try {
+               new (node(i).value()) T(std::forward<X>(value));
+            }
+            catch (...) {
+               link(free_, i, i);
+               throw;
+            }
+            return link(head_, i, i);
+         }
+
+         // Prepend a range of values to the head of the stack. The
+         // last value in the range ends up on top, as if each value
+         // had been pushed individually. Returns true if the stack
+         // was empty before the operation.
+         template<typename Iterator>
+         bool push(Iterator bgn, Iterator end) {
+            if (bgn == end)
+               return false;
+
+            uint32_t top = Null;
+            uint32_t bottom = Null;
+            try {
+               for (; bgn != end; ++bgn) {
+                  const uint32_t i = allocate();
+                  try {
+                     new (node(i).value()) T(*bgn);
+                  }
+                  catch (...) {
+                     link(free_, i, i);
+                     throw;
+                  }
+                  node(i).next_.store(top, std::memory_order_relaxed);
+                  top = i;
+                  if (bottom == Null)
+                     bottom = i;
+               }
+            }
+            catch (...) {
+               if (top != Null) {
+                  for (uint32_t i = top; ; i = node(i).next_.load(std::memory_order_relaxed)) {
+                     node(i).value()->~T();
+                     if (i == bottom)
+                        break;
+                  }
+                  link(free_, top, bottom);
+               }
+               throw;
+            }
+            return link(head_, top, bottom);
+         }
+
+         // Retrieve a value from the head of the stack into the
+         // reference argument. Returns true if successful, i.e. if the
+         // stack was not empty.
+         bool pop(T& result) {
+            return pop(&result, 1) != 0;
+         }
+
+         // Retrieve up to n values from the head of the stack into
+         // the array argument with a single compare-and-swap. Returns
+         // the number of values retrieved.
+         size_t pop(T *results, size_t n) {
+            uint32_t top, bottom;
+            const size_t count = unlink(head_, n, top, bottom);
+            uint32_t i = top;
+            for (size_t k = 0; k < count; ++k) {
+               T *value = node(i).value();
+               results[k] = std::move(*value);
+               value->~T();
+               i = node(i).next_.load(std::memory_order_relaxed);
+            }
+
+            if (count)
+               link(free_, top, bottom);
+            return count;
+         }
+
+      private:
+         static constexpr uint32_t Null = 0xffffffff;
+         static constexpr uint64_t Empty = Null;
+
+         // Chunk k holds BaseChunk << k nodes, so MaxChunks chunks
+         // cover every index below Null.
+         static constexpr uint32_t BaseChunk = 1024;
+         static constexpr unsigned int MaxChunks = 22;
+
+         struct Node {
+            typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+            std::atomic<uint32_t> next_;
+
+            T *value() {
+               return reinterpret_cast<T *>(&storage_);
+            }
+         };
+
+         static uint32_t index(uint64_t head) {
+            return static_cast<uint32_t>(head);
+         }
+
+         static uint64_t pack(uint32_t i, uint64_t oldHead) {
+            return ((oldHead >> 32) + 1) << 32 | i;
+         }
+
+         static unsigned int log2(uint32_t x) {
+#ifdef __GNUC__
+            return 31 - __builtin_clz(x);
+#else
+            unsigned int n = 0;
+            while (x >>= 1)
+               ++n;
+            return n;
+#endif
+         }
+
+         Node& node(uint32_t i) {
+            const unsigned int k = log2(i/BaseChunk + 1);
+            const uint32_t first = BaseChunk*((1U << k) - 1);
+            return chunks_[k].load(std::memory_order_acquire)[i - first];
+         }
+
+         // Push a chain of nodes linked from top to bottom. Returns
+         // true if the stack was empty.
+         bool link(std::atomic<uint64_t>& head, uint32_t top, uint32_t bottom) {
+            uint64_t oldHead = head.load(std::memory_order_relaxed);
+            do {
+               node(bottom).next_.store(index(oldHead), std::memory_order_relaxed);
+            } while (!head.compare_exchange_weak(oldHead, pack(top, oldHead),
+                                                 std::memory_order_release,
+                                                 std::memory_order_relaxed));
+            return index(oldHead) == Null;
+         }
+
+         // Pop a chain of up to n nodes. The nodes below the head
+         // can't change while they are in the stack, and any change
+         // to the head changes its tag, so if the compare-and-swap
+         // succeeds the chain that was read is intact. Returns the
+         // number of nodes.
+         size_t unlink(std::atomic<uint64_t>& head, size_t n, uint32_t& top, uint32_t& bottom) {
+            uint64_t oldHead = head.load(std::memory_order_acquire);
+            while (true) {
+               top = index(oldHead);
+               if (top == Null || n == 0)
+                  return 0;
+
+               size_t count = 1;
+               bottom = top;
+               uint32_t next = node(bottom).next_.load(std::memory_order_relaxed);
+               while (count < n && next != Null) {
+                  bottom = next;
+                  next = node(bottom).next_.load(std::memory_order_relaxed);
+                  ++count;
+               }
+
+               if (head.compare_exchange_weak(oldHead, pack(next, oldHead),
+                                              std::memory_order_acquire,
+                                              std::memory_order_acquire))
+                  return count;
+            }
+         }
+
+         // Get a free node, adding a chunk if necessary.
+         uint32_t allocate() {
+            uint32_t i, bottom;
+            if (unlink(free_, 1, i, bottom))
+               return i;
+
+            std::lock_guard<std::mutex> lock(growMutex_);
+            if (unlink(free_, 1, i, bottom))
+               return i;
+
+            const unsigned int k = chunkCount_;
+            if (k == MaxChunks)
+               throw std::length_error("LockFreeStack is full");
+            const uint32_t size = BaseChunk << k;
+            const uint32_t first = BaseChunk*((1U << k) - 1);
+            Node *chunk = new Node[size];
+            for (uint32_t j = 1; j < size - 1; ++j)
+               chunk[j].next_.store(first + j + 1, std::memory_order_relaxed);
+            chunks_[k].store(chunk, std::memory_order_release);
+            ++chunkCount_;
+
+            // Keep the first node and free the rest.
+            link(free_, first + 1, first + size - 1);
+            return first;
+         }
+
+         // Attempt to put each member variable on its own cache line.
+         char pad[CacheLineSize];
+         union {
+            std::atomic<uint64_t> head_;
+            char padHead[CacheLineSize];
+         };
+         union {
+            std::atomic<uint64_t> free_;
+            char padFree[CacheLineSize];
+         };
+         std::atomic<Node *> chunks_[MaxChunks];
+         unsigned int chunkCount_;
+         std::mutex growMutex_;
+      };
+
+      // Bounded single-producer single-consumer ring buffer. push()
+      // must only be called from one thread and pop() from one
+      // (possibly different) thread. Each side caches the other's
+      // index so it only reads the shared cache line when the ring
+      // looks full or empty.
+      template<typename T>
+      class SpscRing {
+      public:
+         // @capacity Rounded up to a power of two.
+         explicit SpscRing(size_t capacity)
+            : mask_(roundUp(capacity) - 1)
+            , slots_(mask_ + 1)
+            , head_(0)
+            , tailCache_(0)
+            , tail_(0)
+            , headCache_(0) {
+         }
+
+         SpscRing(const SpscRing&) = delete;
+         SpscRing& operator=(const SpscRing&) = delete;
+
+         // Append a value. Returns false if the ring is full, in
+         // which case the value is not moved.
+         bool push(T&& value) {
+            const size_t tail = tail_.load(std::memory_order_relaxed);
+            if (tail - headCache_ > mask_) {
+               headCache_ = head_.load(std::memory_order_acquire);
+               if (tail - headCache_ > mask_)
+                  return false;
+            }
+            slots_[tail & mask_] = std::move(value);
+            tail_.store(tail + 1, std::memory_order_release);
+            return true;
+         }
+
+         // Remove a value. Returns false if the ring is empty.
+         bool pop(T& value) {
+            const size_t head = head_.load(std::memory_order_relaxed);
+            if (head == tailCache_) {
+               tailCache_ = tail_.load(std::memory_order_acquire);
+               if (head == tailCache_)
+                  return false;
+            }
+            value = std::move(slots_[head & mask_]);
+            head_.store(head + 1, std::memory_order_release);
+            return true;
+         }
+
+         // Check for values, from the consumer thread.
+         bool empty() const {
+            return head_.load(std::memory_order_relaxed) == tail_.load(std::memory_order_acquire);
+         }
+
+      private:
+         static size_t roundUp(size_t n) {
+            size_t result = 1;
+            while (result < n)
+               result <<= 1;
+            return result;
+         }
+
+         const size_t mask_;
+         std::vector<T> slots_;
+
+         // Consumer and producer state on separate cache lines.
+         // Padding rather than alignas keeps plain new usable
+         // without C++17 aligned allocation.
+         char padHead[CacheLineSize];
+         std::atomic<size_t> head_;
+         size_t tailCache_;
+         char padTail[CacheLineSize];
+         std::atomic<size_t> tail_;
+         size_t headCache_;
+         char padEnd[CacheLineSize];
+      };
+
+
+      // Queue with a fixed number of priority bands, each a FIFO
+      // ConcurrentQueue. Band 0 has the highest priority. Values
+      // pushed without a band go to the lowest priority band.
+      //
+      // pop() normally takes from the highest priority non-empty
+      // band, but every StarvationInterval-th pop by a thread starts
+      // its search at a rotating band instead, so every band is
+      // guaranteed a share of the throughput even when higher bands
+      // are never empty. Note that this means synchronize() on a
+      // ThreadPoolT using this queue only orders jobs within the
+      // lowest band.
+      template<typename T, size_t Bands = 3>
+      struct PriorityQueue {
+         static_assert(Bands > 0, "at least one band is required");
+         static constexpr unsigned int StarvationInterval = 8;
+
+         typedef size_t Key;
+
+         template<typename U>
+         using rebind = PriorityQueue<U, Bands>;
+
+         PriorityQueue()
+            : size_(0) {
+         }
+
+         template<typename X>
+         bool push(X&& value) {
+            return push(std::forward<X>(value), Bands - 1);
+         }
+
+         template<typename Iterator>
+         bool push(Iterator bgn, Iterator end) {
+            const size_t n = std::distance(bgn, end);
+            if (!n)
+               return false;
+
+            auto& band = bands_[Bands - 1];
+            const bool wasEmpty = size_.fetch_add(n) == 0;
+            band.size_.fetch_add(n, std::memory_order_relaxed);
+            try {
+               band.queue_.push(bgn, end);
+            }
+            catch (...) {
+               band.size_.fetch_sub(n, std::memory_order_relaxed);
+               size_.fetch_sub(n);
+               throw;
+            }
+            return wasEmpty;
+         }
+
+         // Append a value to the tail of the specified band. Returns
+         // true if the entire queue was empty before the operation.
+         template<typename X>
+         bool push(X&& value, size_t priority) {
+            if (priority >= Bands)
+               throw std::out_of_range("invalid priority band");
+
+            // The total size determines emptiness, as the individual
+            // band queues can't tell whether the other bands are
+            // empty without a race. Sizes are incremented before the
+            // value is visible so a pop can't decrement them first.
+            auto& band = bands_[priority];
+            const bool wasEmpty = size_.fetch_add(1) == 0;
+            band.size_.fetch_add(1, std::memory_order_relaxed);
+            try {
+               band.queue_.push(std::forward<X>(value));
+            }
+            catch (...) {
+               band.size_.fetch_sub(1, std::memory_order_relaxed);
+               size_.fetch_sub(1);
+               throw;
+            }
+            return wasEmpty;
+         }
+
+         bool pop(T& result) {
+            return pop(&result, 1) != 0;
+         }
+
+         // Retrieve up to n values from a single band.
+         size_t pop(T *results, size_t n) {
+            static thread_local unsigned int tick = 0;
+            const size_t start = (++tick % StarvationInterval) ? 0 : (tick/StarvationInterval) % Bands;
+            for (size_t i = 0; i < Bands; ++i) {
+               auto& band = bands_[(start + i) % Bands];
+               if (band.size_.load(std::memory_order_relaxed)) {
+                  if (const size_t count = band.queue_.pop(results, n)) {
+                     band.size_.fetch_sub(count, std::memory_order_relaxed);
+                     size_.fetch_sub(count);
+                     return count;
+                  }
+               }
+            }
+            return 0;
+         }
+
+      private:
+         struct Band {
+            ConcurrentQueue<T> queue_;
+            union {
+               std::atomic<size_t> size_;
+               char padSize[CacheLineSize];
+            };
+
+            Band()
+               : size_(0) {
+            }
+         };
+
+         Band bands_[Bands];
+         union {
+            std::atomic<size_t> size_;
+            char padSize[CacheLineSize];
+         };
+      };
+
+      // Queue with named sub-queues served by deficit round robin.
+      //
+      // Each sub-queue is a FIFO with a weight, and is created on
+      // its first push or setWeight(). Values pushed without a name
+      // go to the sub-queue named "". Non-empty sub-queues take
+      // turns, and on its turn a sub-queue may supply up to its
+      // weight in values (every value counts as one unit of work,
+      // as job costs are not known in advance), so when all
+      // sub-queues are busy each receives a share of the throughput
+      // in proportion to its weight no matter how many values it
+      // holds. Note that this means synchronize() on a ThreadPoolT
+      // using this queue only orders jobs within the "" sub-queue.
+      //
+      // All sub-queues share a single lock, as the round robin
+      // state is global.
+      template<typename T>
+      struct FairQueue {
+         // Sub-queue statistics.
+         struct Stats {
+            std::string name;
+            unsigned int weight;
+            size_t depth;        // values currently queued
+            size_t pushed;       // values pushed since creation
+            size_t popped;       // values popped since creation
+         };
+
+         typedef std::string Key;
+
+         template<typename U>
+         using rebind = FairQueue<U>;
+
+         FairQueue()
+            : size_(0) {
+         }
+
+         FairQueue(const FairQueue&) = delete;
+         FairQueue& operator=(const FairQueue&) = delete;
+
+         // Set the weight of a sub-queue, creating it if necessary.
+         void setWeight(const std::string& name, unsigned int weight) {
+            if (weight == 0)
+               throw std::invalid_argument("weight must be positive");
+
+            std::lock_guard<SpinLock> lock(lock_);
+            queues_[name].weight_ = weight;
+         }
+
+         // Get statistics for every sub-queue, ordered by name.
+         std::vector<Stats> stats() const {
+            std::vector<Stats> result;
+            std::lock_guard<SpinLock> lock(lock_);
+            for (const auto& value : queues_) {
+               const SubQueue& q = value.second;
+               result.push_back(Stats{ value.first, q.weight_, q.values_.size(), q.pushed_, q.popped_ });
+            }
+            return result;
+         }
+
+         template<typename X>
+         bool push(X&& value) {
+            return push(std::forward<X>(value), std::string());
+         }
+
+         template<typename Iterator>
+         bool push(Iterator bgn, Iterator end) {
+            const size_t n = std::distance(bgn, end);
+            if (!n)
+               return false;
+
+            std::lock_guard<SpinLock> lock(lock_);
+            SubQueue& q = queues_[std::string()];
+            q.values_.insert(q.values_.end(), bgn, end);
+            return added(q, n);
+         }
+
+         // Append a value to the tail of the named sub-queue. Returns
+         // true if the entire queue was empty before the operation.
+         template<typename X>
+         bool push(X&& value, const std::string& name) {
+            std::lock_guard<SpinLock> lock(lock_);
+            SubQueue& q = queues_[name];
+            q.values_.push_back(std::forward<X>(value));
+            return added(q, 1);
+         }
+
+         bool pop(T& result) {
+            return pop(&result, 1) != 0;
+         }
+
+         // Retrieve up to n values from the sub-queue whose turn it
+         // is.
+         size_t pop(T *results, size_t n) {
+            if (!size_.load(std::memory_order_relaxed))
+               return 0;
+
+            std::lock_guard<SpinLock> lock(lock_);
+            if (active_.empty())
+               return 0;
+
+            SubQueue& q = *active_.front();
+            if (q.deficit_ == 0)
+               q.deficit_ = q.weight_;
+
+            const size_t count = std::min(n, std::min(q.deficit_, q.values_.size()));
+            for (size_t i = 0; i < count; ++i) {
+               results[i] = std::move(q.values_.front());
+               q.values_.pop_front();
+            }
+            q.deficit_ -= count;
+            q.popped_ += count;
+            size_.fetch_sub(count, std::memory_order_relaxed);
+
+            // An emptied sub-queue forfeits its remaining deficit.
+            if (q.values_.empty()) {
+               q.deficit_ = 0;
+               active_.pop_front();
+            }
+            else if (q.deficit_ == 0) {
+               active_.pop_front();
+               active_.push_back(&q);
+            }
+            return count;
+         }
+
+      private:
+         struct SubQueue {
+            std::deque<T> values_;
+            unsigned int weight_ = 1;
+            size_t deficit_ = 0;
+            size_t pushed_ = 0;
+            size_t popped_ = 0;
+         };
+
+         // Account for n values appended to q (lock held).
+         bool added(SubQueue& q, size_t n) {
+            if (q.values_.size() == n)
+               active_.push_back(&q);
+            q.pushed_ += n;
+            return size_.fetch_add(n, std::memory_order_relaxed) == 0;
+         }
+
+         mutable SpinLock lock_;
+         std::map<std::string, SubQueue> queues_;
+         std::deque<SubQueue *> active_;
+         std::atomic<size_t> size_;
+      };
+
+      // Exception for a job rejected because its deadline passed.
+      struct deadline_expired : public std::runtime_error {
+         deadline_expired()
+            : std::runtime_error("deadline expired") {
+         }
+      };
+
+      // Queue ordered by deadline (earliest deadline first).
+      //
+      // Values are pushed with a std::chrono::steady_clock deadline,
+      // e.g. through ThreadPoolT::post(deadline, f), and values with
+      // equal deadlines (including all values pushed without one,
+      // which never expire) are FIFO. A single heap is shared by all
+      // threads so the order is global.
+      //
+      // The queue does not inspect the clock itself. Jobs posted
+      // with a deadline check it when they start, count a miss if
+      // it has passed, and reject with deadline_expired instead of
+      // running if setRejectExpired(true) was called.
+      template<typename T>
+      struct DeadlineQueue {
+         typedef std::chrono::steady_clock Clock;
+
+         typedef Clock::time_point Key;
+
+         template<typename U>
+         using rebind = DeadlineQueue<U>;
+
+         DeadlineQueue()
+            : sequence_(0)
+            , size_(0)
+            , rejectExpired_(false)
+            , misses_(0) {
+         }
+
+         DeadlineQueue(const DeadlineQueue&) = delete;
+         DeadlineQueue& operator=(const DeadlineQueue&) = delete;
+
+         // Select whether jobs that start after their deadline are
+         // rejected (true) or run late (false, the default).
+         void setRejectExpired(bool reject) {
+            rejectExpired_.store(reject, std::memory_order_relaxed);
+         }
+
+         bool getRejectExpired() const {
+            return rejectExpired_.load(std::memory_order_relaxed);
+         }
+
+         // Get the number of jobs that started after their deadline,
+         // whether rejected or run.
+         size_t getMissCount() const {
+            return misses_.load(std::memory_order_relaxed);
+         }
+
+         // Record a job that started after its deadline.
+         void miss() {
+            misses_.fetch_add(1, std::memory_order_relaxed);
+         }
+
+         template<typename X>
+         bool push(X&& value) {
+            return push(std::forward<X>(value), Clock::time_point::max());
+         }
+
+         template<typename Iterator>
+         bool push(Iterator bgn, Iterator end) {
+            const size_t n = std::distance(bgn, end);
+            if (!n)
+               return false;
+
+            std::lock_guard<SpinLock> lock(lock_);
+            heap_.reserve(heap_.size() + n);
+            for (; bgn != end; ++bgn)
+               insert(*bgn, Clock::time_point::max());
+            return size_.fetch_add(n, std::memory_order_relaxed) == 0;
+         }
+
+         // Insert a value with a deadline. Returns true if the queue
+         // was empty before the operation.
+         template<typename X>
+         bool push(X&& value, Clock::time_point deadline) {
+            std::lock_guard<SpinLock> lock(lock_);
+            insert(std::forward<X>(value), deadline);
+            return size_.fetch_add(1, std::memory_order_relaxed) == 0;
+         }
+
+         bool pop(T& result) {
+            return pop(&result, 1) != 0;
+         }
+
+         // Retrieve up to n values in deadline order.
+         size_t pop(T *results, size_t n) {
+            if (!size_.load(std::memory_order_relaxed))
+               return 0;
+
+            std::lock_guard<SpinLock> lock(lock_);
+            size_t count = 0;
+            while (count < n && !heap_.empty()) {
+               std::pop_heap(heap_.begin(), heap_.end(), Later());
+               results[count++] = std::move(heap_.back().value_);
+               heap_.pop_back();
+            }
+            size_.fetch_sub(count, std::memory_order_relaxed);
+            return count;
+         }
+
+      private:
+         struct Entry {
+            Clock::time_point deadline_;
+            uint64_t sequence_;
+            T value_;
+         };
+
+         // Heap comparator placing the earliest deadline on top.
+         struct Later {
+            bool operator()(const Entry& a, const Entry& b) const {
+               return a.deadline_ != b.deadline_ ?
+                  a.deadline_ > b.deadline_ :
+                  a.sequence_ > b.sequence_;
+            }
+         };
+
+         // Add a value to the heap (lock held).
+         template<typename X>
+         void insert(X&& value, Clock::time_point deadline) {
+            heap_.push_back(Entry{ deadline, sequence_++, T(std::forward<X>(value)) });
+            std::push_heap(heap_.begin(), heap_.end(), Later());
+         }
+
+         SpinLock lock_;
+         std::vector<Entry> heap_;
+         uint64_t sequence_;
+         std::atomic<size_t> size_;
+         std::atomic<bool> rejectExpired_;
+         std::atomic<size_t> misses_;
+      };
+
+      // Job wrapper for ThreadPoolT::post(deadline, f).
+      template<typename F, typename Q>
+      struct DeadlineCall {
+         typedef typename CallableTraits<F>::ResultType Result;
+
+         F f_;
+         std::chrono::steady_clock::time_point deadline_;
+         Q *queue_;
+
+         Result operator()() const {
+            if (std::chrono::steady_clock::now() > deadline_) {
+               queue_->miss();
+               if (queue_->getRejectExpired())
+                  throw deadline_expired();
+            }
+            return f_();
+         }
+      };
+
    }
 }
@@ -1,59 +1,18 @@
 #include <atomic>
 #include <future>
 #include <iostream>
-#include <mutex>
 
+#include <poolqueue/Strand.hpp>
 #include <poolqueue/ThreadPool.hpp>
 
 // A Strand invokes functions in the order they are posted
 // asynchronously (on the ThreadPool) with no concurrency. This
 // can be useful, for example, in managing access to a resource
 // without blocking.
-template<typename TP>
-class Strand {
-   TP& tp_;
-   std::mutex mutex_;
-
-   // The last posted task provides the place to add the next task.
-   poolqueue::Promise tail_;
-public:
-   Strand(TP& threadPool)
-      : tp_(threadPool)
-      , tail_(poolqueue::Promise().settle()) {
-   }
-
-   // Movable but not copyable (std::mutex member can't be copied).
-   Strand(Strand&&) = default;
-   Strand& operator=(Strand&&) = default;
-   
-   template<typename F>
-   poolqueue::Promise post(F&& f) {
-      std::lock_guard<std::mutex> lock(mutex_);
-
-      // When the previously last task completes...
-      poolqueue::Promise p = tail_.then([this, f]() {
-         // ...schedule the input function. The returned Promise
-         // will settle p with the result of the function.
-         return tp_.post(f);
-      });
-
-      // This is a minor optimization that just guarantees we won't be
-      // calling then() or except() on the Promise currently in tail_
-      // from now on. The behavior is correct whether this line is
-      // present or not.
-      tail_.close();
-
-      // Update the Promise to chain onto. We can't use the Promise
-      // returned to the user because the user could close it, so
-      // create a dependent Promise and use that.
-      tail_ = p.then([](){ return nullptr; }, [](){ return nullptr; });
-      return p;
-   }
-};
 
 int main() {
    poolqueue::ThreadPool tp;
-   Strand<decltype(tp)> strand(tp);
+   poolqueue::Strand<decltype(tp)> strand(tp);
 
    // Schedule a bunch of tasks on the strand. Verify that they
    // execute in order and that they do not overlap.
@@ -0,0 +1,94 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE BlockingPool
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <boost/test/unit_test.hpp>
+
+#include "BlockingPool.hpp"
+#include "TestUtil.hpp"
+#include "ThreadPool.hpp"
+
+using poolqueue::BlockingPool;
+using poolqueue::Promise;
+using poolqueue::ThreadPool;
+using poolqueue::test::wait;
+
+BOOST_AUTO_TEST_CASE(basic) {
+   BlockingPool pool(8, std::chrono::milliseconds(50));
+   BOOST_CHECK_EQUAL(pool.getThreadCount(), 0);
+
+   // Blocked jobs each get a thread, up to the maximum.
+   std::promise<void> gate;
+   std::shared_future<void> opened(gate.get_future());
+   std::atomic<int> count(0);
+   for (int i = 0; i < 16; ++i) {
+      pool.post([&]() {
+         opened.wait();
+         ++count;
+         return nullptr;
+      });
+   }
+   BOOST_CHECK_EQUAL(pool.getThreadCount(), 8);
+   gate.set_value();
+
+   // Idle threads exit after the keep-alive period.
+   const auto t0 = std::chrono::steady_clock::now();
+   while (pool.getThreadCount() > 0 &&
+          std::chrono::steady_clock::now() - t0 < std::chrono::seconds(5))
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   BOOST_CHECK_EQUAL(pool.getThreadCount(), 0);
+   BOOST_CHECK_EQUAL(count, 16);
+}
+
+BOOST_AUTO_TEST_CASE(postBlocking) {
+   ThreadPool tp(1);
+
+   // Blocking jobs don't hold up the compute pool and their results
+   // are delivered there. The jobs wait until their callbacks are
+   // attached, or a callback could run on this thread.
+   std::promise<void> start;
+   std::shared_future<void> started(start.get_future());
+   std::vector<Promise> promises;
+   std::atomic<int> count(0);
+   std::atomic<int> offPool(0);
+   const auto t0 = std::chrono::steady_clock::now();
+   for (int i = 0; i < 8; ++i) {
+      promises.push_back(tp.postBlocking([=]() {
+         started.wait();
+         std::this_thread::sleep_for(std::chrono::milliseconds(100));
+         return i;
+      }).then([&](int value) {
+         if (tp.index() < 0)
+            ++offPool;
+         count += value;
+         return nullptr;
+      }));
+   }
+   start.set_value();
+
+   wait(Promise::all(promises.begin(), promises.end()));
+   BOOST_CHECK_EQUAL(count, 28);
+   BOOST_CHECK_EQUAL(offPool, 0);
+   BOOST_CHECK(std::chrono::steady_clock::now() - t0 < std::chrono::milliseconds(800));
+
+   // Exceptions are delivered too. The job waits until the
+   // callback is attached, or the callback would run here.
+   std::promise<void> gate;
+   std::shared_future<void> opened(gate.get_future());
+   std::promise<int> rejected;
+   tp.postBlocking([opened]() {
+      opened.wait();
+      throw std::runtime_error("blocked");
+      return nullptr;
+   }).except([&](const std::exception_ptr&) {
+      rejected.set_value(tp.index());
+      return nullptr;
+   });
+   gate.set_value();
+   BOOST_CHECK_GE(rejected.get_future().get(), 0);
+}
@@ -0,0 +1,117 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE Parallel
+
+#include <atomic>
+#include <cmath>
+#include <future>
+#include <iostream>
+#include <numeric>
+#include <string>
+#include <vector>
+#include <boost/format.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "Parallel.hpp"
+#include "TestUtil.hpp"
+#include "ThreadPool.hpp"
+
+using poolqueue::Promise;
+using poolqueue::ThreadPool;
+using poolqueue::test::wait;
+
+BOOST_AUTO_TEST_CASE(parallelFor) {
+   ThreadPool tp(4);
+
+   std::vector<int> v(10000, 0);
+   std::atomic<int> nThreadCalls(0);
+   wait(poolqueue::parallelFor(tp, 0, v.size(), [&](size_t i) {
+      if (tp.index() >= 0)
+         ++nThreadCalls;
+      ++v[i];
+   }));
+
+   BOOST_CHECK_EQUAL(nThreadCalls, v.size());
+   for (int n : v)
+      BOOST_CHECK_EQUAL(n, 1);
+
+   // Empty range.
+   BOOST_CHECK(poolqueue::parallelFor(tp, 5, 5, [](size_t) {}).settled());
+}
+
+BOOST_AUTO_TEST_CASE(parallelReduce) {
+   ThreadPool tp(4);
+
+   std::promise<size_t> sum;
+   poolqueue::parallelReduce(
+      tp, 1, 1001, size_t(0),
+      [](size_t i) { return i; },
+      [](size_t a, size_t b) { return a + b; })
+      .then([&](size_t value) {
+         sum.set_value(value);
+         return nullptr;
+      });
+   BOOST_CHECK_EQUAL(sum.get_future().get(), 1000*1001/2);
+
+   // String concatenation is associative but not commutative.
+   std::promise<std::string> s;
+   poolqueue::parallelReduce(
+      tp, 0, 26, std::string(),
+      [](size_t i) { return std::string(1, static_cast<char>('a' + i)); },
+      [](const std::string& a, const std::string& b) { return a + b; })
+      .then([&](const std::string& value) {
+         s.set_value(value);
+         return nullptr;
+      });
+   BOOST_CHECK_EQUAL(s.get_future().get(), "abcdefghijklmnopqrstuvwxyz");
+}
+
+BOOST_AUTO_TEST_CASE(exception) {
+   ThreadPool tp(4);
+
+   std::promise<std::string> message;
+   poolqueue::parallelFor(tp, 0, 1000, [](size_t i) {
+      if (i == 500)
+         throw std::runtime_error("foo");
+   }).except([&](const std::exception_ptr& e) {
+      try {
+         std::rethrow_exception(e);
+      }
+      catch (const std::exception& e) {
+         message.set_value(e.what());
+      }
+      return nullptr;
+   });
+   BOOST_CHECK_EQUAL(message.get_future().get(), "foo");
+}
+
+BOOST_AUTO_TEST_CASE(performance) {
+   ThreadPool tp;
+
+   // Compare against posting one function per index.
+   const size_t n = 1 << 20;
+   std::vector<double> v(n);
+
+   auto bgnTime = std::chrono::steady_clock::now();
+   std::vector<Promise> promises;
+   for (size_t i = 0; i < n; ++i) {
+      promises.push_back(tp.post([&v, i]() {
+         v[i] = std::sqrt(static_cast<double>(i));
+         return nullptr;
+      }));
+   }
+   wait(Promise::all(promises.begin(), promises.end()));
+   auto endTime = std::chrono::steady_clock::now();
+   const auto postElapsed = std::chrono::duration<double>(endTime - bgnTime);
+
+   bgnTime = std::chrono::steady_clock::now();
+   wait(poolqueue::parallelFor(tp, 0, n, [&v](size_t i) {
+      v[i] = std::sqrt(static_cast<double>(i));
+   }));
+   endTime = std::chrono::steady_clock::now();
+   const auto parallelElapsed = std::chrono::duration<double>(endTime - bgnTime);
+
+   std::cout << boost::format("%12d indices: post %.6f seconds, parallelFor %.6f seconds\n")
+      % n
+      % postElapsed.count()
+      % parallelElapsed.count();
+}
@@ -0,0 +1,140 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE ShardedPool
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include <boost/format.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "ShardedPool.hpp"
+#include "TestUtil.hpp"
+
+using poolqueue::Promise;
+using poolqueue::ShardedPool;
+using poolqueue::ThreadPool;
+using poolqueue::test::wait;
+
+BOOST_AUTO_TEST_CASE(basic) {
+   ShardedPool pool(3, {});
+   BOOST_CHECK_EQUAL(pool.getShardCount(), 3);
+   BOOST_CHECK_EQUAL(pool.index(), -1);
+   BOOST_CHECK_THROW(pool.submitTo(3, []() { return nullptr; }), std::out_of_range);
+
+   // Jobs run on the requested shard.
+   for (unsigned int i = 0; i < pool.getShardCount(); ++i)
+      BOOST_CHECK_EQUAL(wait<int>(pool.submitTo(i, [&]() { return pool.index(); })), i);
+
+   BOOST_CHECK_THROW(
+      wait<int>(pool.submitTo(1, []() -> int { throw std::runtime_error("job"); })),
+      std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(reply) {
+   ShardedPool pool(2, {});
+
+   // A result is delivered on the submitting shard.
+   std::promise<std::pair<int, int> > indices;
+   pool.submitTo(0, [&]() {
+      pool.submitTo(1, [&]() { return pool.index(); })
+         .then([&](int target) {
+            indices.set_value(std::make_pair(target, pool.index()));
+            return nullptr;
+         });
+      return nullptr;
+   });
+   auto result = indices.get_future().get();
+   BOOST_CHECK_EQUAL(result.first, 1);
+   BOOST_CHECK_EQUAL(result.second, 0);
+
+   // Sending more jobs than a ring holds.
+   std::atomic<int> count(0);
+   std::promise<void> done;
+   const int n = 10000;
+   pool.submitTo(0, [&]() {
+      for (int i = 0; i < n; ++i) {
+         pool.submitTo(1, [&]() { return ++count; })
+            .then([&](int c) {
+               if (c == n)
+                  done.set_value();
+               return nullptr;
+            });
+      }
+      return nullptr;
+   });
+   done.get_future().wait();
+   BOOST_CHECK_EQUAL(count, n);
+}
+
+BOOST_AUTO_TEST_CASE(destructor) {
+   // Jobs submitted by jobs complete before destruction.
+   std::atomic<int> count(0);
+   {
+      ShardedPool pool(4, {});
+      for (unsigned int i = 0; i < 4; ++i) {
+         pool.submitTo(i, [&, i]() {
+            for (unsigned int j = 0; j < 1000; ++j)
+               pool.submitTo(j % 4, [&]() { return ++count; });
+            return nullptr;
+         });
+      }
+   }
+   BOOST_CHECK_EQUAL(count, 4000);
+}
+
+BOOST_AUTO_TEST_CASE(performance) {
+   // Each shard sends a chain of jobs around the ring of shards.
+   const unsigned int nShards = std::max(std::thread::hardware_concurrency(), 2U);
+   const int n = 1 << 16;
+   std::atomic<int> remaining;
+   std::promise<void> done;
+   std::function<void(int)> relay;
+
+   double shardedTime;
+   {
+      ShardedPool pool(nShards, {});
+      remaining = nShards;
+      relay = [&](int hops) {
+         if (hops == 0) {
+            if (--remaining == 0)
+               done.set_value();
+            return;
+         }
+         const unsigned int next = (pool.index() + 1) % nShards;
+         pool.submitTo(next, [&, hops]() { relay(hops - 1); return nullptr; });
+      };
+
+      auto t0 = std::chrono::steady_clock::now();
+      for (unsigned int i = 0; i < nShards; ++i)
+         pool.submitTo(i, [&]() { relay(n); return nullptr; });
+      done.get_future().wait();
+      shardedTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+   }
+
+   double poolTime;
+   {
+      ThreadPool tp(nShards);
+      std::promise<void> done;
+      remaining = nShards;
+      relay = [&](int hops) {
+         if (hops == 0) {
+            if (--remaining == 0)
+               done.set_value();
+            return;
+         }
+         tp.post([&, hops]() { relay(hops - 1); return nullptr; });
+      };
+
+      auto t0 = std::chrono::steady_clock::now();
+      for (unsigned int i = 0; i < nShards; ++i)
+         tp.post([&]() { relay(n); return nullptr; });
+      done.get_future().wait();
+      poolTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+   }
+
+   std::cout << boost::format("%d shards x %d hops: ShardedPool %.6f seconds, ThreadPool %.6f seconds\n")
+      % nShards % n % shardedTime % poolTime;
+}
@@ -0,0 +1,131 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE Strand
+
+#include <atomic>
+#include <future>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <boost/format.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "Strand.hpp"
+#include "TestUtil.hpp"
+#include "ThreadPool.hpp"
+
+using poolqueue::Promise;
+using poolqueue::ThreadPool;
+using poolqueue::test::wait;
+typedef poolqueue::Strand<ThreadPool> Strand;
+
+BOOST_AUTO_TEST_CASE(order) {
+   ThreadPool tp(4);
+   Strand strand(tp);
+
+   // Post from several threads. Functions from each thread must run
+   // in order and no two functions may overlap.
+   const int nThreads = 4;
+   const int n = 10000;
+   std::atomic<int> active(0);
+   std::vector<int> last(nThreads, -1);
+   std::vector<std::thread> threads;
+   for (int t = 0; t < nThreads; ++t) {
+      threads.emplace_back([&, t]() {
+         for (int i = 0; i < n; ++i) {
+            strand.post([&, t, i]() {
+               BOOST_CHECK_EQUAL(++active, 1);
+               BOOST_CHECK_GE(tp.index(), 0);
+               BOOST_CHECK_EQUAL(last[t], i - 1);
+               last[t] = i;
+               --active;
+               return nullptr;
+            });
+         }
+      });
+   }
+   for (auto& thread : threads)
+      thread.join();
+
+   std::promise<void> done;
+   strand.post([&]() {
+      done.set_value();
+      return nullptr;
+   });
+   done.get_future().wait();
+   for (int t = 0; t < nThreads; ++t)
+      BOOST_CHECK_EQUAL(last[t], n - 1);
+}
+
+BOOST_AUTO_TEST_CASE(result) {
+   ThreadPool tp;
+   Strand strand(tp);
+
+   std::promise<int> value;
+   strand.post([]() { return 42; })
+      .then([&](int i) {
+         value.set_value(i);
+         return nullptr;
+      });
+   BOOST_CHECK_EQUAL(value.get_future().get(), 42);
+
+   // An exception doesn't stop the Strand.
+   std::promise<void> rejected;
+   strand.post([]() -> std::nullptr_t { throw std::runtime_error("foo"); })
+      .except([&](const std::exception_ptr&) {
+         rejected.set_value();
+         return nullptr;
+      });
+   rejected.get_future().wait();
+
+   std::promise<void> done;
+   strand.post([&]() {
+      done.set_value();
+      return nullptr;
+   });
+   done.get_future().wait();
+}
+
+BOOST_AUTO_TEST_CASE(lifetime) {
+   ThreadPool tp;
+
+   // Functions still run after the Strand handle is destroyed.
+   std::promise<void> done;
+   {
+      Strand strand(tp);
+      for (int i = 0; i < 100; ++i)
+         strand.post([]() { return nullptr; });
+      strand.post([&]() {
+         done.set_value();
+         return nullptr;
+      });
+   }
+   done.get_future().wait();
+}
+
+BOOST_AUTO_TEST_CASE(performance) {
+   ThreadPool tp;
+
+   // Measure how quickly n functions can run on each of 100 strands.
+   std::vector<Strand> strands(100, Strand(tp));
+   size_t n = 1;
+   auto elapsed = std::chrono::microseconds(0);
+   do {
+      auto bgnTime = std::chrono::steady_clock::now();
+      std::vector<Promise> promises;
+      for (auto& strand : strands) {
+         for (size_t i = 0; i < n; ++i)
+            strand.post([]() { return nullptr; });
+         promises.push_back(strand.post([]() { return nullptr; }));
+      }
+
+      wait(Promise::all(promises.begin(), promises.end()));
+      auto endTime = std::chrono::steady_clock::now();
+
+      elapsed = std::chrono::duration_cast<decltype(elapsed)>(endTime - bgnTime);
+      std::cout << boost::format("%12d functions in %.6f seconds\n")
+         % (strands.size()*(n + 1))
+         % static_cast<double>(elapsed.count()/1000000.0);
+
+      n *= 4;
+   } while (elapsed < std::chrono::milliseconds(500));
+}
@@ -0,0 +1,239 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE TaskGraph
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <vector>
+#include <boost/format.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "TaskGraph.hpp"
+#include "TestUtil.hpp"
+#include "ThreadPool.hpp"
+
+using poolqueue::Promise;
+using poolqueue::ThreadPool;
+typedef poolqueue::TaskGraph<ThreadPool> TaskGraph;
+using poolqueue::test::wait;
+
+namespace {
+   // Layered graph where each node depends on every node in the
+   // previous layer.
+   const size_t Width = 8;
+   const size_t Depth = 64;
+}
+
+BOOST_AUTO_TEST_CASE(basic) {
+   ThreadPool tp;
+
+   // Empty graph.
+   TaskGraph empty(tp);
+   BOOST_CHECK(empty.run().settled());
+
+   // Diamond.
+   std::mutex mutex;
+   std::vector<char> order;
+   auto record = [&](char c) {
+      return [&, c]() {
+         std::lock_guard<std::mutex> lock(mutex);
+         order.push_back(c);
+      };
+   };
+
+   TaskGraph graph(tp);
+   auto a = graph.add(record('a'));
+   auto b = graph.add(record('b'));
+   auto c = graph.add(record('c'));
+   auto d = graph.add(record('d'));
+   graph.precede(a, b);
+   graph.precede(a, c);
+   graph.precede(b, d);
+   graph.precede(c, d);
+   BOOST_CHECK_EQUAL(graph.size(), 4);
+   BOOST_CHECK_THROW(graph.precede(a, 4), std::out_of_range);
+
+   // The same graph runs repeatedly.
+   for (int i = 0; i < 100; ++i) {
+      order.clear();
+      wait(graph.run());
+      BOOST_REQUIRE_EQUAL(order.size(), 4);
+      BOOST_CHECK_EQUAL(order.front(), 'a');
+      BOOST_CHECK_EQUAL(order.back(), 'd');
+   }
+
+   // A graph can be extended between runs.
+   auto e = graph.add(record('e'));
+   graph.precede(d, e);
+   order.clear();
+   wait(graph.run());
+   BOOST_REQUIRE_EQUAL(order.size(), 5);
+   BOOST_CHECK_EQUAL(order.back(), 'e');
+}
+
+BOOST_AUTO_TEST_CASE(layers) {
+   ThreadPool tp;
+
+   std::vector<std::atomic<size_t> > counts(Depth);
+   std::atomic<bool> ordered(true);
+   TaskGraph graph(tp);
+   std::vector<TaskGraph::Node> previous;
+   for (size_t i = 0; i < Depth; ++i) {
+      std::vector<TaskGraph::Node> layer;
+      for (size_t j = 0; j < Width; ++j) {
+         layer.push_back(graph.add([&, i]() {
+            // Every node in the previous layer must be done.
+            if (i > 0 && counts[i - 1].load() % Width)
+               ordered = false;
+            ++counts[i];
+         }));
+         for (auto node : previous)
+            graph.precede(node, layer.back());
+      }
+      previous.swap(layer);
+   }
+
+   for (auto& count : counts)
+      count = 0;
+   for (int i = 0; i < 10; ++i)
+      wait(graph.run());
+   for (auto& count : counts)
+      BOOST_CHECK_EQUAL(count.load(), 10*Width);
+   BOOST_CHECK(ordered);
+}
+
+BOOST_AUTO_TEST_CASE(exception) {
+   ThreadPool tp;
+
+   std::atomic<int> count(0);
+   TaskGraph graph(tp);
+   auto a = graph.add([&]() { ++count; throw std::runtime_error("node"); });
+   auto b = graph.add([&]() { ++count; });
+   graph.precede(a, b);
+   BOOST_CHECK_THROW(wait(graph.run()), std::runtime_error);
+   BOOST_CHECK_EQUAL(count, 1);
+
+   // Cycles are detected when the graph runs.
+   TaskGraph cycle(tp);
+   auto c = cycle.add([]() {});
+   auto d = cycle.add([]() {});
+   cycle.precede(c, d);
+   cycle.precede(d, c);
+   BOOST_CHECK_THROW(cycle.run(), std::logic_error);
+
+   // A running graph cannot be run or modified.
+   std::promise<void> release;
+   std::shared_future<void> released(release.get_future());
+   TaskGraph busy(tp);
+   busy.add([=]() { released.wait(); });
+   Promise p = busy.run();
+   BOOST_CHECK_THROW(busy.run(), std::logic_error);
+   BOOST_CHECK_THROW(busy.add([]() {}), std::logic_error);
+   release.set_value();
+   wait(p);
+}
+
+BOOST_AUTO_TEST_CASE(capacity) {
+   ThreadPool tp(1);
+   tp.setCapacity(2, ThreadPool::Overflow::Reject);
+
+   // Nodes the pool rejects run inline instead.
+   std::promise<void> release;
+   std::shared_future<void> released(release.get_future());
+   std::atomic<int> count(0);
+   TaskGraph graph(tp);
+   auto root = graph.add([&]() { released.wait(); ++count; });
+   for (size_t i = 0; i < 8; ++i)
+      graph.precede(root, graph.add([&]() { ++count; }));
+   Promise p = graph.run();
+   release.set_value();
+   wait(p);
+   BOOST_CHECK_EQUAL(count, 9);
+
+   // The graph is idle again afterwards.
+   count = 0;
+   for (size_t i = 0; i < Width; ++i)
+      graph.add([&]() { ++count; });
+   wait(graph.run());
+   BOOST_CHECK_EQUAL(count, 9 + Width);
+}
+
+BOOST_AUTO_TEST_CASE(longChain) {
+   // A chain of nodes that the pool keeps handing back must not
+   // recurse once per node.
+   const size_t n = 200000;
+   for (auto policy : { ThreadPool::Overflow::Reject, ThreadPool::Overflow::CallerRuns }) {
+      ThreadPool tp(1);
+      tp.setCapacity(1, policy);
+
+      size_t count = 0;
+      bool ordered = true;
+      TaskGraph graph(tp);
+      for (size_t i = 0; i < n; ++i) {
+         graph.add([&, i]() {
+            ordered = ordered && count == i;
+            ++count;
+         });
+         if (i)
+            graph.precede(i - 1, i);
+      }
+      wait(graph.run());
+      BOOST_CHECK_EQUAL(count, n);
+      BOOST_CHECK(ordered);
+   }
+}
+
+BOOST_AUTO_TEST_CASE(performance) {
+   ThreadPool tp;
+
+   std::atomic<size_t> count(0);
+   auto node = [&]() { ++count; };
+
+   TaskGraph graph(tp);
+   std::vector<TaskGraph::Node> previous;
+   for (size_t i = 0; i < Depth; ++i) {
+      std::vector<TaskGraph::Node> layer;
+      for (size_t j = 0; j < Width; ++j) {
+         layer.push_back(graph.add(node));
+         for (auto p : previous)
+            graph.precede(p, layer.back());
+      }
+      previous.swap(layer);
+   }
+
+   const int Runs = 100;
+   auto t0 = std::chrono::steady_clock::now();
+   for (int i = 0; i < Runs; ++i)
+      wait(graph.run());
+   auto t1 = std::chrono::steady_clock::now();
+
+   // Equivalent graph built from Promise dependencies each run.
+   for (int i = 0; i < Runs; ++i) {
+      std::vector<Promise> previous;
+      for (size_t j = 0; j < Depth; ++j) {
+         std::vector<Promise> layer;
+         for (size_t k = 0; k < Width; ++k) {
+            if (previous.empty()) {
+               layer.push_back(tp.post([&]() { node(); return nullptr; }));
+            }
+            else {
+               layer.push_back(Promise::all(previous.begin(), previous.end()).then([&]() {
+                  return tp.post([&]() { node(); return nullptr; });
+               }));
+            }
+         }
+         previous.swap(layer);
+      }
+      wait(Promise::all(previous.begin(), previous.end()));
+   }
+   auto t2 = std::chrono::steady_clock::now();
+   BOOST_CHECK_EQUAL(count, 2*Runs*Width*Depth);
+
+   std::cout << boost::format("%dx%d graph: TaskGraph %.6f seconds, Promise %.6f seconds\n")
+      % Width % Depth
+      % (std::chrono::duration<double>(t1 - t0).count()/Runs)
+      % (std::chrono::duration<double>(t2 - t1).count()/Runs);
+}
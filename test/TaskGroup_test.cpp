@@ -0,0 +1,230 @@
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MODULE TaskGroup
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+#include <boost/format.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "TaskGroup.hpp"
+#include "TestUtil.hpp"
+#include "ThreadPool.hpp"
+
+using poolqueue::Promise;
+using poolqueue::ThreadPool;
+using poolqueue::test::wait;
+using poolqueue::test::waitIdle;
+typedef poolqueue::TaskGroup<ThreadPool> TaskGroup;
+
+namespace {
+   const int Cutoff = 12;
+   const size_t SortCutoff = 1024;
+   
+   long fibSerial(int n) {
+      return n < 2 ? n : fibSerial(n - 1) + fibSerial(n - 2);
+   }
+
+   long fibGroup(ThreadPool& tp, int n) {
+      if (n < Cutoff)
+         return fibSerial(n);
+
+      long a, b;
+      TaskGroup group(tp);
+      group.spawn([&]() { a = fibGroup(tp, n - 1); });
+      b = fibGroup(tp, n - 2);
+      group.wait();
+      return a + b;
+   }
+
+   Promise fibPromise(ThreadPool& tp, int n) {
+      if (n < Cutoff)
+         return Promise().settle(fibSerial(n));
+
+      return tp.post([&tp, n]() {
+         return Promise::all({ fibPromise(tp, n - 1), fibPromise(tp, n - 2) })
+            .then([](const std::vector<long>& v) {
+               return v[0] + v[1];
+            });
+      });
+   }
+
+   typedef std::vector<int>::iterator Iterator;
+   
+   // Split off the elements equal to the pivot so both halves
+   // shrink.
+   std::pair<Iterator, Iterator> partition(Iterator bgn, Iterator end) {
+      const int pivot = *(bgn + (end - bgn)/2);
+      Iterator mid1 = std::partition(bgn, end, [=](int x) { return x < pivot; });
+      Iterator mid2 = std::partition(mid1, end, [=](int x) { return !(pivot < x); });
+      return std::make_pair(mid1, mid2);
+   }
+   
+   void sortGroup(ThreadPool& tp, Iterator bgn, Iterator end) {
+      if (static_cast<size_t>(end - bgn) < SortCutoff) {
+         std::sort(bgn, end);
+         return;
+      }
+
+      const auto mid = partition(bgn, end);
+      TaskGroup group(tp);
+      group.spawn([&]() { sortGroup(tp, bgn, mid.first); });
+      sortGroup(tp, mid.second, end);
+      group.wait();
+   }
+
+   Promise sortPromise(ThreadPool& tp, Iterator bgn, Iterator end) {
+      if (static_cast<size_t>(end - bgn) < SortCutoff) {
+         std::sort(bgn, end);
+         return Promise().settle();
+      }
+
+      return tp.post([&tp, bgn, end]() {
+         const auto mid = partition(bgn, end);
+         return Promise::all({ sortPromise(tp, bgn, mid.first), sortPromise(tp, mid.second, end) });
+      });
+   }
+
+   std::vector<int> randomVector(size_t n) {
+      std::mt19937 generator(42);
+      std::uniform_int_distribution<int> distribution(0, 1 << 20);
+      std::vector<int> v(n);
+      for (auto& x : v)
+         x = distribution(generator);
+      return v;
+   }
+}
+
+BOOST_AUTO_TEST_CASE(basic) {
+   ThreadPool tp;
+
+   std::atomic<int> count(0);
+   TaskGroup group(tp);
+   for (int i = 0; i < 1000; ++i)
+      group.spawn([&]() { ++count; });
+   group.wait();
+   BOOST_CHECK_EQUAL(count, 1000);
+
+   // A group can be reused.
+   group.spawn([&]() { ++count; });
+   group.wait();
+   BOOST_CHECK_EQUAL(count, 1001);
+
+   // Waiting in a single thread pool must not deadlock.
+   ThreadPool tp1(1);
+   std::promise<long> result;
+   tp1.post([&]() {
+      result.set_value(fibGroup(tp1, 20));
+      return nullptr;
+   });
+   BOOST_CHECK_EQUAL(result.get_future().get(), fibSerial(20));
+}
+
+BOOST_AUTO_TEST_CASE(exception) {
+   ThreadPool tp;
+
+   TaskGroup group(tp);
+   std::atomic<int> count(0);
+   for (int i = 0; i < 100; ++i) {
+      group.spawn([&, i]() {
+         ++count;
+         if (i == 50)
+            throw std::runtime_error("task");
+      });
+   }
+   BOOST_CHECK_THROW(group.wait(), std::runtime_error);
+   BOOST_CHECK_EQUAL(count, 100);
+
+   // The exception is only delivered once.
+   group.wait();
+}
+
+BOOST_AUTO_TEST_CASE(capacity) {
+   ThreadPool tp(1);
+   tp.setCapacity(1, ThreadPool::Overflow::Reject);
+
+   // Tasks whose jobs the pool rejects run once, in wait().
+   std::promise<void> gate;
+   std::shared_future<void> opened(gate.get_future());
+   tp.post([=]() {
+      opened.wait();
+      return nullptr;
+   });
+
+   std::vector<std::atomic<int> > counts(8);
+   for (auto& count : counts)
+      count = 0;
+   TaskGroup group(tp);
+   for (auto& count : counts)
+      BOOST_CHECK_NO_THROW(group.spawn([&]() { ++count; }));
+   group.wait();
+   gate.set_value();
+   for (auto& count : counts)
+      BOOST_CHECK_EQUAL(count.load(), 1);
+
+   // Recursive groups complete on a full pool.
+   waitIdle(tp);
+   BOOST_CHECK_EQUAL(fibGroup(tp, 20), fibSerial(20));
+}
+
+BOOST_AUTO_TEST_CASE(fib) {
+   ThreadPool tp;
+   for (int n = 0; n < 25; ++n)
+      BOOST_CHECK_EQUAL(fibGroup(tp, n), fibSerial(n));
+   BOOST_CHECK_EQUAL(wait<long>(fibPromise(tp, 24)), fibSerial(24));
+}
+
+BOOST_AUTO_TEST_CASE(sort) {
+   ThreadPool tp;
+
+   auto v = randomVector(1 << 18);
+   auto expected = v;
+   std::sort(expected.begin(), expected.end());
+
+   auto u = v;
+   sortGroup(tp, u.begin(), u.end());
+   BOOST_CHECK(u == expected);
+
+   u = v;
+   wait(sortPromise(tp, u.begin(), u.end()));
+   BOOST_CHECK(u == expected);
+}
+
+BOOST_AUTO_TEST_CASE(performance) {
+   ThreadPool tp;
+
+   for (int n = 20; n <= 32; n += 4) {
+      auto t0 = std::chrono::steady_clock::now();
+      const long a = fibGroup(tp, n);
+      auto t1 = std::chrono::steady_clock::now();
+      const long b = wait<long>(fibPromise(tp, n));
+      auto t2 = std::chrono::steady_clock::now();
+      BOOST_CHECK_EQUAL(a, b);
+
+      std::cout << boost::format("fib(%d): TaskGroup %.6f seconds, Promise %.6f seconds\n")
+         % n
+         % std::chrono::duration<double>(t1 - t0).count()
+         % std::chrono::duration<double>(t2 - t1).count();
+   }
+
+   for (size_t n = 1 << 16; n <= (1 << 22); n <<= 2) {
+      auto v = randomVector(n);
+      auto u = v;
+      auto t0 = std::chrono::steady_clock::now();
+      sortGroup(tp, u.begin(), u.end());
+      auto t1 = std::chrono::steady_clock::now();
+      wait(sortPromise(tp, v.begin(), v.end()));
+      auto t2 = std::chrono::steady_clock::now();
+      BOOST_CHECK(u == v);
+      
+      std::cout << boost::format("%10d element sort: TaskGroup %.6f seconds, Promise %.6f seconds\n")
+         % n
+         % std::chrono::duration<double>(t1 - t0).count()
+         % std::chrono::duration<double>(t2 - t1).count();
+   }
+}
@@ -0,0 +1,58 @@
+#ifndef poolqueue_TestUtil_hpp
+#define poolqueue_TestUtil_hpp
+
+#include <exception>
+#include <future>
+
+#include "Promise.hpp"
+
+// Helpers shared by the tests.
+namespace poolqueue {
+   namespace test {
+      // Block until a Promise settles.
+      // @p Promise to wait for.
+      //
+      // @return The fulfilled value. A rejection is rethrown.
+      template<typename T>
+      T wait(const Promise& p) {
+         std::promise<T> result;
+         p.then(
+            [&](const T& value) {
+               result.set_value(value);
+               return nullptr;
+            },
+            [&](const std::exception_ptr& e) {
+               result.set_exception(e);
+               return nullptr;
+            });
+         return result.get_future().get();
+      }
+
+      // Block until a Promise settles, ignoring any value.
+      // @p Promise to wait for.
+      //
+      // A rejection is rethrown.
+      inline void wait(const Promise& p) {
+         std::promise<void> result;
+         p.then(
+            [&]() {
+               result.set_value();
+               return nullptr;
+            },
+            [&](const std::exception_ptr& e) {
+               result.set_exception(e);
+               return nullptr;
+            });
+         result.get_future().get();
+      }
+
+      // Block until a pool has no outstanding jobs.
+      // @pool Pool with a whenIdle() method.
+      template<typename Pool>
+      void waitIdle(Pool& pool) {
+         wait(pool.whenIdle());
+      }
+   }
+}
+
+#endif // poolqueue_TestUtil_hpp
@@ -1,8 +1,10 @@
 #define BOOST_TEST_DYN_LINK
 #define BOOST_TEST_MODULE ThreadPool
 
+#include <algorithm>
 #include <cmath>
 #include <iostream>
+#include <memory>
 #include <future>
 #include <mutex>
 #include <numeric>
@@ -11,8 +13,13 @@
 #include <boost/format.hpp>
 #include <boost/test/unit_test.hpp>
 
+#include "Delay.hpp"
+#include "TestUtil.hpp"
 #include "ThreadPool.hpp"
 
+using poolqueue::test::wait;
+using poolqueue::test::waitIdle;
+
 BOOST_AUTO_TEST_CASE(basic) {
    using namespace poolqueue;
    ThreadPool tp;
@@ -43,6 +50,22 @@ BOOST_AUTO_TEST_CASE(basic) {
    BOOST_CHECK_EQUAL(count, 3);
 }
 
+BOOST_AUTO_TEST_CASE(threadIndex) {
+   using namespace poolqueue;
+   ThreadPool a(2), b(2);
+
+   // A thread has an index only in its own pool.
+   std::promise<std::pair<int, int> > indices;
+   a.post([&]() {
+      indices.set_value(std::make_pair(a.index(), b.index()));
+      return nullptr;
+   });
+   const auto result = indices.get_future().get();
+   BOOST_CHECK_GE(result.first, 0);
+   BOOST_CHECK_LT(result.first, 2);
+   BOOST_CHECK_EQUAL(result.second, -1);
+}
+
 BOOST_AUTO_TEST_CASE(stack) {
    using namespace poolqueue;
    ThreadPoolT<detail::ConcurrentStack<Promise> > tp;
@@ -69,10 +92,100 @@ BOOST_AUTO_TEST_CASE(stack) {
       return nullptr;
    })();
 
+   tp.postN(3, [&](size_t) {
+      std::lock_guard<std::mutex> lock(exclusive);
+      BOOST_CHECK_GE(tp.index(), 0);
+      ++count;
+      return nullptr;
+   });
+
    // synchronize() won't work because stack is not FIFO.
-   while (count < 3)
-      std::this_thread::yield();
-   BOOST_CHECK_EQUAL(count, 3);
+   waitIdle(tp);
+   BOOST_CHECK_EQUAL(count, 6);
+}
+
+BOOST_AUTO_TEST_CASE(lockFreeStack) {
+   using namespace poolqueue;
+   ThreadPoolT<detail::LockFreeStack<Promise>, false> tp;
+
+   std::atomic<int> count(0);
+   tp.post([&]() { ++count; return nullptr; });
+   tp.postN(1000, [&](size_t) { ++count; return nullptr; });
+   for (int i = 0; i < 1000; ++i)
+      tp.execute([&]() { ++count; });
+
+   waitIdle(tp);
+   BOOST_CHECK_EQUAL(count, 2001);
+
+   // Every value pushed concurrently is popped exactly once.
+   detail::LockFreeStack<int> stack;
+   const int nThreads = 4;
+   const int n = 100000;
+   std::vector<int> seen(nThreads*n);
+   std::vector<std::thread> threads;
+   for (int t = 0; t < nThreads; ++t) {
+      threads.emplace_back([&, t]() {
+         int values[8];
+         for (int i = 0; i < n; ++i) {
+            stack.push(t*n + i);
+            if (i % 2) {
+               const size_t count = stack.pop(values, 8);
+               for (size_t j = 0; j < count; ++j)
+                  ++seen[values[j]];
+            }
+         }
+      });
+   }
+   for (auto& t : threads)
+      t.join();
+
+   int value;
+   while (stack.pop(value))
+      ++seen[value];
+   BOOST_CHECK(std::all_of(seen.begin(), seen.end(), [](int k) { return k == 1; }));
+
+   // Range push keeps the last value on top.
+   std::vector<int> v = { 1, 2, 3 };
+   BOOST_CHECK(stack.push(v.begin(), v.end()));
+   BOOST_CHECK(!stack.push(4));
+   int values[4];
+   BOOST_REQUIRE_EQUAL(stack.pop(values, 4), 4);
+   BOOST_CHECK_EQUAL(values[0], 4);
+   BOOST_CHECK_EQUAL(values[1], 3);
+   BOOST_CHECK_EQUAL(values[3], 1);
+}
+
+namespace {
+   // Time nThreads threads each pushing and popping n values.
+   template<typename Stack>
+   double stackContention(unsigned int nThreads, int n) {
+      Stack stack;
+      std::vector<std::thread> threads;
+      const auto t0 = std::chrono::steady_clock::now();
+      for (unsigned int t = 0; t < nThreads; ++t) {
+         threads.emplace_back([&]() {
+            int value = 0;
+            for (int i = 0; i < n; ++i) {
+               stack.push(i);
+               stack.pop(value);
+            }
+         });
+      }
+      for (auto& t : threads)
+         t.join();
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+   }
+}
+
+BOOST_AUTO_TEST_CASE(stackPerformance) {
+   using namespace poolqueue;
+   const int n = 1 << 20;
+   for (unsigned int nThreads = 1; nThreads <= 2*std::max(std::thread::hardware_concurrency(), 1U); nThreads *= 2) {
+      std::cout << boost::format("%2d threads x %d push/pop: ConcurrentStack %.6f seconds, LockFreeStack %.6f seconds\n")
+         % nThreads % n
+         % stackContention<detail::ConcurrentStack<int> >(nThreads, n)
+         % stackContention<detail::LockFreeStack<int> >(nThreads, n);
+   }
 }
 
 BOOST_AUTO_TEST_CASE(promise) {
@@ -161,6 +274,958 @@ BOOST_AUTO_TEST_CASE(dispatch) {
    promise.get_future().wait();
 }
 
+BOOST_AUTO_TEST_CASE(batch) {
+   using namespace poolqueue;
+   ThreadPool tp;
+
+   std::vector<std::function<int()> > functions;
+   for (int i = 0; i < 100; ++i)
+      functions.push_back([=, &tp]() {
+         BOOST_CHECK_GE(tp.index(), 0);
+         return i;
+      });
+   auto promises = tp.postBatch(functions.begin(), functions.end());
+   BOOST_CHECK_EQUAL(promises.size(), functions.size());
+
+   bool complete = false;
+   Promise::all(promises.begin(), promises.end())
+      .then([&](const std::vector<int>& values) {
+         for (size_t i = 0; i < values.size(); ++i)
+            BOOST_CHECK_EQUAL(values[i], i);
+         complete = true;
+         return nullptr;
+      });
+   tp.synchronize().wait();
+   BOOST_CHECK(complete);
+
+   std::atomic<size_t> sum(0);
+   promises = tp.postN(100, [&](size_t i) {
+      sum += i;
+      return i;
+   });
+   BOOST_CHECK_EQUAL(promises.size(), 100);
+   tp.synchronize().wait();
+   BOOST_CHECK_EQUAL(sum, 99*100/2);
+
+   BOOST_CHECK(tp.postBatch(functions.end(), functions.end()).empty());
+}
+
+namespace {
+   // Move-only functor with a large capture.
+   struct BigJob {
+      std::unique_ptr<int> p_;
+      char data_[256];
+      std::atomic<int> *count_;
+
+      void operator()() const {
+         *count_ += *p_;
+      }
+   };
+}
+
+BOOST_AUTO_TEST_CASE(execute) {
+   poolqueue::ThreadPool tp;
+
+   // Small functions are stored inline, large or move-only ones on
+   // the heap.
+   std::atomic<int> count(0);
+   auto token = std::make_shared<int>(0);
+   for (int i = 0; i < 1000; ++i) {
+      tp.execute([&count, token]() {
+         ++count;
+      });
+      tp.execute(BigJob{std::unique_ptr<int>(new int(2)), {}, &count});
+   }
+
+   waitIdle(tp);
+   BOOST_CHECK_EQUAL(count, 3000);
+
+   // Functions are released once run.
+   BOOST_CHECK_EQUAL(token.use_count(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(next) {
+   poolqueue::ThreadPool tp(2);
+
+   // Occupy one thread so the other has no idle thread to steal
+   // from it.
+   std::promise<void> gate;
+   std::shared_future<void> opened(gate.get_future());
+   std::promise<void> blocked;
+   tp.post([&]() {
+      blocked.set_value();
+      opened.wait();
+      return nullptr;
+   });
+   blocked.get_future().wait();
+
+   // A job posted from a pool thread runs next on that thread, and
+   // the newest such job displaces older ones to the queue.
+   std::mutex mutex;
+   std::vector<std::pair<char, int> > order;
+   std::promise<void> done;
+   auto record = [&](char c) {
+      std::lock_guard<std::mutex> lock(mutex);
+      order.push_back(std::make_pair(c, tp.index()));
+      if (order.size() == 14)
+         done.set_value();
+   };
+   std::promise<void> queued;
+   std::shared_future<void> isQueued(queued.get_future());
+   std::function<void(int)> chain = [&](int n) {
+      record('0' + n);
+      if (n < 9)
+         tp.execute([&chain, n]() { chain(n + 1); });
+   };
+   tp.execute([&]() {
+      record('R');
+      isQueued.wait();
+      tp.execute([&]() { record('A'); });
+      tp.execute([&]() { record('B'); });
+      tp.execute([&]() { chain(0); });
+   });
+
+   // This job is in the queue before the chain starts.
+   tp.execute([&]() { record('X'); });
+   queued.set_value();
+
+   done.get_future().wait();
+   gate.set_value();
+   tp.synchronize().wait();
+
+   std::string sequence;
+   for (const auto& entry : order) {
+      sequence += entry.first;
+      BOOST_CHECK_EQUAL(entry.second, order[0].second);
+   }
+   BOOST_CHECK_EQUAL(sequence.substr(0, 2), "R0");
+
+   // The chain can't starve the queue.
+   BOOST_CHECK_LT(sequence.find('X'), sequence.find('9'));
+   BOOST_CHECK_LT(sequence.find('A'), sequence.find('9'));
+}
+
+BOOST_AUTO_TEST_CASE(capacity) {
+   typedef poolqueue::ThreadPool::Overflow Overflow;
+   poolqueue::ThreadPool tp(1);
+   BOOST_CHECK_EQUAL(tp.getCapacity(), 0);
+
+   // Hold the only thread.
+   std::promise<void> gate;
+   std::shared_future<void> opened(gate.get_future());
+   auto blocker = [=]() {
+      opened.wait();
+      return nullptr;
+   };
+
+   // Rejection.
+   tp.setCapacity(4, Overflow::Reject);
+   BOOST_CHECK_EQUAL(tp.getCapacity(), 4);
+   for (int i = 0; i < 4; ++i)
+      tp.post(blocker);
+   BOOST_CHECK_EQUAL(tp.getDepth(), 4);
+
+   bool rejected = false;
+   tp.post([]() { return nullptr; })
+      .except([&](const std::exception_ptr& e) {
+         try {
+            std::rethrow_exception(e);
+         }
+         catch (const std::length_error&) {
+            rejected = true;
+         }
+         return nullptr;
+      });
+   BOOST_CHECK(rejected);
+   BOOST_CHECK_THROW(tp.execute([]() {}), std::length_error);
+   BOOST_CHECK_EQUAL(tp.getDepth(), 4);
+
+   // Caller runs.
+   tp.setCapacity(4, Overflow::CallerRuns);
+   std::thread::id runner;
+   tp.post([&]() {
+      runner = std::this_thread::get_id();
+      return nullptr;
+   });
+   BOOST_CHECK(runner == std::this_thread::get_id());
+
+   // Blocking.
+   tp.setCapacity(2, Overflow::Block);
+   std::atomic<bool> posted(false);
+   std::thread producer([&]() {
+      tp.post([]() { return nullptr; });
+      posted = true;
+   });
+   std::this_thread::sleep_for(std::chrono::milliseconds(50));
+   BOOST_CHECK(!posted);
+   gate.set_value();
+   producer.join();
+   BOOST_CHECK(posted);
+
+   // Depth stays within capacity for a single producer.
+   size_t maxDepth = 0;
+   for (int i = 0; i < 100; ++i) {
+      tp.post([]() {
+         std::this_thread::sleep_for(std::chrono::microseconds(100));
+         return nullptr;
+      });
+      maxDepth = std::max(maxDepth, tp.getDepth());
+   }
+   tp.synchronize().wait();
+   BOOST_CHECK_LE(maxDepth, 2);
+
+   tp.setCapacity(0);
+}
+
+BOOST_AUTO_TEST_CASE(blocking) {
+   poolqueue::ThreadPool tp(1);
+
+   // Outside the pool the function just runs.
+   BOOST_CHECK_EQUAL(tp.blocking([]() { return 42; }), 42);
+   
+   // A job that blocks on a later job would deadlock a single
+   // thread pool without a spare.
+   std::promise<void> later;
+   std::shared_future<void> ran(later.get_future());
+   std::promise<int> result;
+   tp.post([&]() {
+      result.set_value(tp.blocking([&]() {
+         ran.wait();
+         return 7;
+      }));
+      return nullptr;
+   });
+   tp.post([&]() {
+      later.set_value();
+      return nullptr;
+   });
+   BOOST_CHECK_EQUAL(result.get_future().get(), 7);
+
+   // The spare exits when no longer needed.
+   const auto t0 = std::chrono::steady_clock::now();
+   while (tp.getThreadCount() > 1 &&
+          std::chrono::steady_clock::now() - t0 < std::chrono::seconds(5))
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   BOOST_CHECK_EQUAL(tp.getThreadCount(), 1);
+   tp.synchronize().wait();
+}
+
+BOOST_AUTO_TEST_CASE(whenIdle) {
+   poolqueue::ThreadPool tp(2);
+
+   // An idle pool settles immediately.
+   BOOST_CHECK(tp.whenIdle().settled());
+
+   // Jobs, including jobs posted by jobs, complete first.
+   std::atomic<int> count(0);
+   for (int i = 0; i < 100; ++i) {
+      tp.post([&]() {
+         std::this_thread::sleep_for(std::chrono::microseconds(100));
+         tp.post([&]() {
+            ++count;
+            return nullptr;
+         });
+         ++count;
+         return nullptr;
+      });
+   }
+
+   waitIdle(tp);
+   BOOST_CHECK_EQUAL(count, 200);
+
+   // Other work keeps flowing while waiting for idle.
+   std::promise<void> gate;
+   std::shared_future<void> opened(gate.get_future());
+   tp.post([=]() {
+      opened.wait();
+      return nullptr;
+   });
+   poolqueue::Promise p = tp.whenIdle();
+   std::promise<void> other;
+   tp.post([&]() {
+      other.set_value();
+      return nullptr;
+   });
+   other.get_future().wait();
+   BOOST_CHECK(!p.settled());
+   gate.set_value();
+
+   wait(p);
+}
+
+BOOST_AUTO_TEST_CASE(batchSynchronize) {
+   poolqueue::ThreadPool tp(4);
+
+   // Workers retrieve jobs in batches. Make sure synchronize()
+   // still completes and orders jobs with a deep queue.
+   std::atomic<int> count(0);
+   for (int i = 0; i < 100; ++i) {
+      tp.postN(200, [&](size_t) {
+         ++count;
+         return nullptr;
+      });
+      tp.synchronize().wait();
+      BOOST_CHECK_EQUAL(count, 200*(i + 1));
+   }
+}
+
+BOOST_AUTO_TEST_CASE(nextSynchronize) {
+   poolqueue::ThreadPool tp(2);
+
+   // A job posted by a pool thread after synchronize() must not
+   // use the next slot to start before the barrier.
+   std::atomic<int> started(0);
+   std::atomic<bool> slowDone(false), ordered(false);
+   std::promise<void> gate;
+   std::shared_future<void> opened(gate.get_future());
+   tp.execute([&]() {
+      ++started;
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      slowDone = true;
+   });
+   tp.execute([&]() {
+      ++started;
+      opened.wait();
+      tp.execute([&]() { ordered = slowDone.load(); });
+   });
+   while (started < 2)
+      std::this_thread::yield();
+
+   auto barrier = tp.synchronize();
+   gate.set_value();
+   barrier.wait();
+   tp.synchronize().wait();
+   BOOST_CHECK(ordered);
+}
+
+BOOST_AUTO_TEST_CASE(priority) {
+   using namespace poolqueue;
+   ThreadPoolT<detail::PriorityQueue<Promise, 3> > tp(1);
+
+   // Block the only thread while jobs are queued.
+   std::promise<void> started, gate;
+   std::shared_future<void> opened(gate.get_future());
+   tp.post(0, [&, opened]() {
+      started.set_value();
+      opened.wait();
+      return nullptr;
+   });
+   started.get_future().wait();
+
+   std::mutex mutex;
+   std::vector<int> order;
+   for (int band : { 2, 1, 0, 2, 1, 0 }) {
+      tp.post(band, [&, band]() {
+         std::lock_guard<std::mutex> lock(mutex);
+         order.push_back(band);
+         return nullptr;
+      });
+   }
+   BOOST_CHECK_THROW(tp.post(3, []() { return nullptr; }), std::out_of_range);
+
+   gate.set_value();
+   tp.synchronize().wait();
+
+   // Starvation protection may occasionally let a lower band go
+   // first, but higher bands should run earlier on the whole.
+   BOOST_REQUIRE_EQUAL(order.size(), 6);
+   int position[3] = { 0, 0, 0 };
+   for (int i = 0; i < 6; ++i)
+      position[order[i]] += i;
+   BOOST_CHECK_LT(position[0], position[2]);
+}
+
+BOOST_AUTO_TEST_CASE(priorityBlocking) {
+   using namespace poolqueue;
+   ThreadPoolT<detail::PriorityQueue<Promise, 3> > tp(1);
+
+   std::promise<void> started, gate;
+   std::shared_future<void> opened(gate.get_future());
+   tp.post(0, [&, opened]() {
+      started.set_value();
+      opened.wait();
+      return nullptr;
+   });
+   started.get_future().wait();
+
+   // Jobs queued with one that calls blocking() keep their
+   // priority. The other band 0 jobs are recorded as 1.
+   std::mutex mutex;
+   std::vector<int> order;
+   auto record = [&](int value) {
+      std::lock_guard<std::mutex> lock(mutex);
+      order.push_back(value);
+   };
+   for (int i = 0; i < 20; ++i)
+      tp.post(2, [&]() { record(2); return nullptr; });
+   tp.post(0, [&]() {
+      tp.blocking([]() { std::this_thread::sleep_for(std::chrono::milliseconds(10)); });
+      record(0);
+      return nullptr;
+   });
+   for (int i = 0; i < 3; ++i)
+      tp.post(0, [&]() { record(1); return nullptr; });
+
+   // Not synchronize(), which would prevent batching.
+   gate.set_value();
+   waitIdle(tp);
+
+   BOOST_REQUIRE_EQUAL(order.size(), 24);
+   order.erase(std::remove(order.begin(), order.end(), 0), order.end());
+   BOOST_CHECK(std::is_sorted(order.begin(), order.end()));
+}
+
+BOOST_AUTO_TEST_CASE(priorityLatency) {
+   using namespace poolqueue;
+   typedef std::chrono::steady_clock Clock;
+   ThreadPoolT<detail::PriorityQueue<Promise, 2> > tp;
+
+   // Keep the pool saturated with low priority work while sampling
+   // the queue latency of jobs in each band.
+   std::atomic<bool> done(false);
+   std::thread producer([&]() {
+      while (!done) {
+         tp.postN(1000, [](size_t) {
+            const auto t = Clock::now();
+            while (Clock::now() - t < std::chrono::microseconds(5))
+               ;
+            return nullptr;
+         });
+         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+   });
+
+   std::mutex mutex;
+   std::vector<double> latencies[2];
+   for (int i = 0; i < 200; ++i) {
+      for (int band = 0; band < 2; ++band) {
+         const auto t = Clock::now();
+         tp.post(band, [&, t, band]() {
+            std::lock_guard<std::mutex> lock(mutex);
+            latencies[band].push_back(std::chrono::duration<double>(Clock::now() - t).count());
+            return nullptr;
+         });
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+   }
+
+   done = true;
+   producer.join();
+   tp.synchronize().wait();
+
+   for (int band = 0; band < 2; ++band) {
+      auto& v = latencies[band];
+      std::sort(v.begin(), v.end());
+      std::cout << boost::format("band %d latency p50 %.6f p99 %.6f seconds\n")
+         % band
+         % v[v.size()/2]
+         % v[v.size()*99/100];
+   }
+}
+
+BOOST_AUTO_TEST_CASE(fair) {
+   using namespace poolqueue;
+   ThreadPoolT<detail::FairQueue<Promise> > tp(1);
+   tp.queue().setWeight("quiet", 3);
+   BOOST_CHECK_THROW(tp.queue().setWeight("quiet", 0), std::invalid_argument);
+
+   // Block the only thread while jobs are queued.
+   std::promise<void> started, gate;
+   std::shared_future<void> opened(gate.get_future());
+   tp.post([&, opened]() {
+      started.set_value();
+      opened.wait();
+      return nullptr;
+   });
+   started.get_future().wait();
+
+   // A flood on one sub-queue does not hold up another.
+   std::mutex mutex;
+   std::string order;
+   for (int i = 0; i < 40; ++i) {
+      tp.post("noisy", [&]() {
+         std::lock_guard<std::mutex> lock(mutex);
+         order.push_back('n');
+         return nullptr;
+      });
+   }
+   for (int i = 0; i < 30; ++i) {
+      tp.post("quiet", [&]() {
+         std::lock_guard<std::mutex> lock(mutex);
+         order.push_back('q');
+         return nullptr;
+      });
+   }
+
+   auto stats = tp.queue().stats();
+   BOOST_REQUIRE_EQUAL(stats.size(), 3);
+   BOOST_CHECK_EQUAL(stats[1].name, "noisy");
+   BOOST_CHECK_EQUAL(stats[1].weight, 1);
+   BOOST_CHECK_EQUAL(stats[1].depth, 40);
+   BOOST_CHECK_EQUAL(stats[2].name, "quiet");
+   BOOST_CHECK_EQUAL(stats[2].depth, 30);
+
+   // Not synchronize(), which only orders the "" sub-queue.
+   gate.set_value();
+   waitIdle(tp);
+
+   // Sub-queues alternate in proportion to their weights.
+   BOOST_REQUIRE_EQUAL(order.size(), 70);
+   BOOST_CHECK_EQUAL(order.substr(0, 8), "nqqqnqqq");
+   BOOST_CHECK_EQUAL(std::count(order.begin(), order.begin() + 40, 'q'), 30);
+
+   stats = tp.queue().stats();
+   for (const auto& s : stats)
+      BOOST_CHECK_EQUAL(s.depth, 0);
+   BOOST_CHECK_EQUAL(stats[1].popped, 40);
+   BOOST_CHECK_EQUAL(stats[2].pushed, 30);
+   BOOST_CHECK_EQUAL(stats[2].popped, 30);
+}
+
+BOOST_AUTO_TEST_CASE(deadline) {
+   using namespace poolqueue;
+   typedef ThreadPoolT<detail::DeadlineQueue<Promise> > Pool;
+   typedef std::chrono::steady_clock Clock;
+   Pool tp(1);
+
+   // Block the only thread while jobs are queued.
+   std::promise<void> started, gate;
+   std::shared_future<void> opened(gate.get_future());
+   tp.post([&, opened]() {
+      started.set_value();
+      opened.wait();
+      return nullptr;
+   });
+   started.get_future().wait();
+
+   std::mutex mutex;
+   std::vector<int> order;
+   auto record = [&](int i) {
+      return [&, i]() {
+         std::lock_guard<std::mutex> lock(mutex);
+         order.push_back(i);
+         return nullptr;
+      };
+   };
+
+   // Jobs without a deadline go last.
+   const auto t = Clock::now() + std::chrono::seconds(60);
+   tp.post(record(-1));
+   for (int i : { 3, 1, 4, 0, 2 })
+      tp.post(t + std::chrono::milliseconds(i), record(i));
+
+   gate.set_value();
+   tp.synchronize().wait();
+   BOOST_CHECK((order == std::vector<int>{ 0, 1, 2, 3, 4, -1 }));
+   BOOST_CHECK_EQUAL(tp.queue().getMissCount(), 0);
+
+   // An expired job runs late by default.
+   order.clear();
+   tp.post(Clock::now() - std::chrono::milliseconds(1), record(0));
+   tp.synchronize().wait();
+   BOOST_CHECK_EQUAL(order.size(), 1);
+   BOOST_CHECK_EQUAL(tp.queue().getMissCount(), 1);
+
+   // Or it can be rejected.
+   std::promise<bool> rejected;
+   tp.queue().setRejectExpired(true);
+   tp.post(Clock::now() - std::chrono::milliseconds(1), record(1))
+      .except([&](const std::exception_ptr& e) {
+         try {
+            std::rethrow_exception(e);
+         }
+         catch (const Pool::deadline_expired&) {
+            rejected.set_value(true);
+         }
+         catch (...) {
+            rejected.set_value(false);
+         }
+         return nullptr;
+      });
+   BOOST_CHECK(rejected.get_future().get());
+   BOOST_CHECK_EQUAL(order.size(), 1);
+   BOOST_CHECK_EQUAL(tp.queue().getMissCount(), 2);
+}
+
+BOOST_AUTO_TEST_CASE(metrics) {
+   using namespace poolqueue;
+   ThreadPool tp(2);
+
+   const int n = 1000;
+   for (int i = 0; i < n; ++i)
+      tp.execute([]() {});
+   tp.post([]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      return nullptr;
+   });
+
+   waitIdle(tp);
+
+   auto m = tp.getMetrics();
+   BOOST_CHECK_EQUAL(m.depth, 0);
+   BOOST_CHECK_EQUAL(m.threads, 2);
+#ifndef POOLQUEUE_NO_METRICS
+   BOOST_CHECK_EQUAL(m.dequeued, n + 1);
+   BOOST_CHECK_EQUAL(m.enqueued, n + 1);
+   BOOST_CHECK_EQUAL(m.runTime.count(), n + 1);
+   BOOST_CHECK(m.queueWait.count() > 0 && m.queueWait.count() <= n + 1);
+   BOOST_CHECK(m.runTime.quantile(1.0) >= std::chrono::milliseconds(10));
+   BOOST_CHECK(m.runTime.quantile(0.5) < std::chrono::milliseconds(10));
+
+   BOOST_REQUIRE_EQUAL(m.workers.size(), 2);
+   uint64_t jobs = 0;
+   std::chrono::nanoseconds busy(0);
+   for (const auto& w : m.workers) {
+      jobs += w.jobs;
+      busy += w.busy;
+   }
+   BOOST_CHECK_EQUAL(jobs, m.dequeued);
+   BOOST_CHECK(busy >= std::chrono::milliseconds(10));
+
+   // Totals survive threads exiting.
+   tp.setThreadCount(1);
+   m = tp.getMetrics();
+   BOOST_CHECK_EQUAL(m.workers.size(), 1);
+   BOOST_CHECK_EQUAL(m.dequeued, n + 1);
+   BOOST_CHECK_EQUAL(m.runTime.count(), n + 1);
+#endif
+}
+
+BOOST_AUTO_TEST_CASE(watchdog) {
+   using namespace poolqueue;
+   ThreadPool tp(2);
+
+   std::mutex mutex;
+   std::vector<std::pair<int, std::chrono::steady_clock::duration> > reports;
+   tp.setWatchdog(std::chrono::milliseconds(20), [&](int index, std::chrono::steady_clock::duration elapsed) {
+      std::lock_guard<std::mutex> lock(mutex);
+      reports.emplace_back(index, elapsed);
+   });
+
+   // Only the slow job is reported, and only once.
+   for (int i = 0; i < 100; ++i)
+      tp.execute([]() {});
+   tp.post([]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+      return nullptr;
+   });
+   tp.synchronize().wait();
+   {
+      std::lock_guard<std::mutex> lock(mutex);
+      BOOST_REQUIRE_EQUAL(reports.size(), 1);
+      BOOST_CHECK(reports[0].first >= 0 && reports[0].first < 2);
+      BOOST_CHECK(reports[0].second > std::chrono::milliseconds(20));
+   }
+
+   tp.clearWatchdog();
+   tp.post([]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      return nullptr;
+   });
+   tp.synchronize().wait();
+   std::lock_guard<std::mutex> lock(mutex);
+   BOOST_CHECK_EQUAL(reports.size(), 1);
+}
+
+namespace {
+   template<typename Wait>
+   void checkWaitPolicy() {
+      using namespace poolqueue;
+      ThreadPoolT<detail::ConcurrentQueue<Promise>, true, Wait> tp(2);
+
+      // Jobs from outside the pool and chained through next slots.
+      const int n = 10000;
+      std::atomic<int> count(0);
+      std::function<void(int)> chain = [&](int i) {
+         ++count;
+         if (i)
+            tp.execute([&, i]() { chain(i - 1); });
+      };
+      for (int i = 0; i < n; ++i)
+         tp.execute([&]() { ++count; });
+      tp.execute([&]() { chain(n - 1); });
+
+      // synchronize() doesn't wait for jobs posted after it is
+      // called, so wait for idle.
+      waitIdle(tp);
+      BOOST_CHECK_EQUAL(count, 2*n);
+
+      // Threads exit while idle.
+      tp.setThreadCount(3);
+      tp.setThreadCount(1);
+      tp.execute([&]() { ++count; });
+      tp.synchronize().wait();
+      BOOST_CHECK_EQUAL(count, 2*n + 1);
+   }
+
+   // Time an external thread posting a job and spinning until it
+   // runs, and posting n jobs.
+   template<typename Wait>
+   std::pair<double, double> timeWaitPolicy(int n) {
+      using namespace poolqueue;
+      ThreadPoolT<detail::ConcurrentQueue<Promise>, true, Wait> tp;
+
+      const int Trials = 200;
+      std::vector<double> latency;
+      for (int i = 0; i < Trials; ++i) {
+         std::atomic<bool> ran(false);
+         std::this_thread::sleep_for(std::chrono::microseconds(100));
+         const auto t0 = std::chrono::steady_clock::now();
+         tp.execute([&]() { ran = true; });
+         while (!ran)
+            std::this_thread::yield();
+         latency.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+      }
+      std::nth_element(latency.begin(), latency.begin() + Trials/2, latency.end());
+
+      std::atomic<int> count(0);
+      const auto t0 = std::chrono::steady_clock::now();
+      for (int i = 0; i < n; ++i)
+         tp.execute([&]() { ++count; });
+      tp.synchronize().wait();
+      BOOST_CHECK_EQUAL(count, n);
+      return std::make_pair(latency[Trials/2], std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count());
+   }
+}
+
+BOOST_AUTO_TEST_CASE(waitPolicy) {
+   using namespace poolqueue;
+   checkWaitPolicy<detail::Blocking>();
+   checkWaitPolicy<detail::SpinYield>();
+   checkWaitPolicy<detail::BusySpin>();
+
+   const int n = 1 << 16;
+   const auto blocking = timeWaitPolicy<detail::Blocking>(n);
+   const auto spinYield = timeWaitPolicy<detail::SpinYield>(n);
+   const auto busySpin = timeWaitPolicy<detail::BusySpin>(n);
+   std::cout << boost::format("median wake latency: Blocking %.9f, SpinYield %.9f, BusySpin %.9f seconds\n")
+      % blocking.first % spinYield.first % busySpin.first;
+   std::cout << boost::format("%d jobs: Blocking %.6f, SpinYield %.6f, BusySpin %.6f seconds\n")
+      % n % blocking.second % spinYield.second % busySpin.second;
+}
+
+BOOST_AUTO_TEST_CASE(shutdown) {
+   using namespace poolqueue;
+   // Count jobs that run and jobs that are cancelled.
+   std::atomic<int> ran(0), cancelled(0);
+   auto post = [&](ThreadPool& tp) {
+      return tp.post([&]() { ++ran; return nullptr; })
+         .except([&](const std::exception_ptr& e) {
+            try {
+               std::rethrow_exception(e);
+            }
+            catch (const ThreadPool::job_cancelled&) {
+               ++cancelled;
+            }
+            return nullptr;
+         });
+   };
+
+   // Block the pool until released.
+   auto block = [](ThreadPool& tp, std::shared_future<void> released) {
+      tp.execute([=]() { released.wait(); });
+   };
+
+   {
+      // Drain runs everything.
+      ThreadPool tp(2);
+      for (int i = 0; i < 100; ++i)
+         post(tp);
+      Promise p = tp.shutdown();
+      wait(p);
+      BOOST_CHECK_EQUAL(ran, 100);
+      BOOST_CHECK_EQUAL(tp.getThreadCount(), 0);
+
+      // Later calls return the same Promise.
+      BOOST_CHECK(tp.shutdown(ThreadPool::Shutdown::Cancel).settled());
+   }
+
+   {
+      // Cancel rejects queued jobs, but a running job completes.
+      ran = 0;
+      std::promise<void> release;
+      ThreadPool tp(1);
+      block(tp, release.get_future().share());
+      std::atomic<bool> executed(false);
+      tp.execute([&]() { executed = true; });
+      for (int i = 0; i < 10; ++i)
+         post(tp);
+      Promise p = tp.shutdown(ThreadPool::Shutdown::Cancel);
+      release.set_value();
+      wait(p);
+      BOOST_CHECK_EQUAL(ran, 0);
+      BOOST_CHECK_EQUAL(cancelled, 10);
+      BOOST_CHECK(!executed);
+   }
+
+   {
+      // Abandon leaves Promises unsettled.
+      cancelled = 0;
+      std::promise<void> release;
+      ThreadPool tp(1);
+      block(tp, release.get_future().share());
+      std::vector<Promise> promises;
+      for (int i = 0; i < 10; ++i)
+         promises.push_back(post(tp));
+      Promise p = tp.shutdown(ThreadPool::Shutdown::Abandon);
+      release.set_value();
+      wait(p);
+      BOOST_CHECK_EQUAL(ran, 0);
+      BOOST_CHECK_EQUAL(cancelled, 0);
+      for (const auto& promise : promises)
+         BOOST_CHECK(!promise.settled());
+   }
+
+   {
+      // Drain switches to Cancel at the deadline.
+      std::promise<void> release;
+      ThreadPool tp(1);
+      block(tp, release.get_future().share());
+      for (int i = 0; i < 10; ++i)
+         post(tp);
+      Promise p = tp.shutdown(
+         ThreadPool::Shutdown::Drain,
+         std::chrono::steady_clock::now() + std::chrono::milliseconds(20));
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      BOOST_CHECK(!p.settled());
+      release.set_value();
+      wait(p);
+      BOOST_CHECK_EQUAL(ran, 0);
+      BOOST_CHECK_EQUAL(cancelled, 10);
+   }
+}
+
+BOOST_AUTO_TEST_CASE(postAfter) {
+   using namespace poolqueue;
+   typedef std::chrono::steady_clock Clock;
+   ThreadPool tp(2);
+
+   // A delayed job runs on a pool thread no sooner than requested.
+   std::promise<std::pair<Clock::time_point, int> > ran;
+   const auto t0 = Clock::now();
+   tp.postAfter(std::chrono::milliseconds(50), [&]() {
+      ran.set_value(std::make_pair(Clock::now(), tp.index()));
+      return nullptr;
+   });
+   const auto result = ran.get_future().get();
+   BOOST_CHECK(result.first - t0 >= std::chrono::milliseconds(50));
+   BOOST_CHECK_GE(result.second, 0);
+
+   // Jobs run in time order, whether posted inside or outside the
+   // pool, and whenIdle() includes them.
+   std::mutex mutex;
+   std::vector<int> order;
+   auto record = [&](int i) {
+      return [&, i]() {
+         std::lock_guard<std::mutex> lock(mutex);
+         order.push_back(i);
+         return nullptr;
+      };
+   };
+   const auto t1 = Clock::now() + std::chrono::milliseconds(20);
+   for (int i = 4; i >= 0; --i)
+      tp.postAt(t1 + std::chrono::milliseconds(10*i), record(i));
+   tp.post([&]() {
+      tp.postAt(t1 + std::chrono::milliseconds(45), record(5));
+      return nullptr;
+   });
+   waitIdle(tp);
+   BOOST_CHECK_EQUAL(order.size(), 6);
+   BOOST_CHECK(std::is_sorted(order.begin(), order.end()));
+
+   // Delayed jobs move to the remaining threads when the count
+   // drops.
+   std::atomic<int> count(0);
+   tp.setThreadCount(4);
+   for (int i = 0; i < 8; ++i)
+      tp.postAfter(std::chrono::milliseconds(20), [&]() { return ++count; });
+   tp.setThreadCount(1);
+   waitIdle(tp);
+   BOOST_CHECK_EQUAL(count, 8);
+
+   // A delayed job posted by a busy thread is run by an idle one.
+   tp.setThreadCount(2);
+   std::promise<Clock::time_point> stolen;
+   std::atomic<bool> release(false);
+   const auto t3 = Clock::now();
+   tp.post([&]() {
+      tp.postAfter(std::chrono::milliseconds(10), [&]() {
+         stolen.set_value(Clock::now());
+         release = true;
+         return nullptr;
+      });
+      while (!release && Clock::now() - t3 < std::chrono::seconds(2))
+         std::this_thread::yield();
+      return nullptr;
+   });
+   BOOST_CHECK(stolen.get_future().get() - t3 < std::chrono::milliseconds(500));
+
+   // Shutdown cancels delayed jobs without waiting for them.
+   std::atomic<bool> cancelled(false);
+   tp.postAfter(std::chrono::hours(1), []() { return nullptr; })
+      .except([&](const std::exception_ptr&) {
+         cancelled = true;
+         return nullptr;
+      });
+   const auto t2 = Clock::now();
+   wait(tp.shutdown(ThreadPool::Shutdown::Cancel));
+   BOOST_CHECK(Clock::now() - t2 < std::chrono::seconds(10));
+   BOOST_CHECK(cancelled);
+
+   // The destructor and a draining shutdown discard delayed jobs
+   // that are not yet due.
+   const auto t4 = Clock::now();
+   {
+      ThreadPool tp1(1);
+      tp1.postAfter(std::chrono::hours(1), []() { return nullptr; });
+      tp1.post([&]() {
+         tp1.postAfter(std::chrono::hours(1), []() { return nullptr; });
+         return nullptr;
+      });
+   }
+   {
+      ThreadPool tp1(1);
+      tp1.postAfter(std::chrono::hours(1), []() { return nullptr; });
+      wait(tp1.shutdown());
+   }
+   BOOST_CHECK(Clock::now() - t4 < std::chrono::seconds(10));
+}
+
+BOOST_AUTO_TEST_CASE(postAfterLatency) {
+   using namespace poolqueue;
+   typedef std::chrono::steady_clock Clock;
+   ThreadPool tp;
+
+   // Lateness of delayed jobs via the pool's timers and via Delay
+   // plus a post.
+   const int n = 100;
+   const auto delay = std::chrono::milliseconds(2);
+   auto measure = [&](std::function<Promise(std::function<double()>)> schedule) {
+      std::vector<double> late;
+      for (int i = 0; i < n; ++i) {
+         const auto t = Clock::now() + delay;
+         std::promise<double> result;
+         schedule([=]() { return std::chrono::duration<double>(Clock::now() - t).count(); })
+            .then([&](double d) {
+               result.set_value(d);
+               return nullptr;
+            });
+         late.push_back(result.get_future().get());
+      }
+      std::nth_element(late.begin(), late.begin() + n/2, late.end());
+      return late[n/2];
+   };
+
+   const double timer = measure([&](std::function<double()> f) {
+      return tp.postAfter(delay, f);
+   });
+   const double hop = measure([&](std::function<double()> f) {
+      return Delay::after(delay).then([&tp, f]() { return tp.post(f); });
+   });
+   std::cout << boost::format("median lateness: postAfter %.9f seconds, Delay + post %.9f seconds\n")
+      % timer % hop;
+}
+
 BOOST_AUTO_TEST_CASE(count) {
    poolqueue::ThreadPool tp;
    
@@ -196,6 +1261,81 @@ BOOST_AUTO_TEST_CASE(count) {
    tp.setThreadCount(nThreads);
 }
 
+BOOST_AUTO_TEST_CASE(autoScale) {
+   poolqueue::ThreadPool tp(1);
+   BOOST_CHECK_THROW(tp.setAutoScale(0, 4, std::chrono::milliseconds(1), std::chrono::milliseconds(50)), std::invalid_argument);
+   BOOST_CHECK_THROW(tp.setAutoScale(2, 1, std::chrono::milliseconds(1), std::chrono::milliseconds(50)), std::invalid_argument);
+   tp.setAutoScale(1, 4, std::chrono::milliseconds(1), std::chrono::milliseconds(50));
+
+   // Backed up jobs should add threads.
+   std::atomic<unsigned int> maxCount(1);
+   for (int i = 0; i < 200; ++i) {
+      tp.post([&]() {
+         std::this_thread::sleep_for(std::chrono::milliseconds(2));
+         unsigned int count = tp.getThreadCount();
+         unsigned int prev = maxCount;
+         while (count > prev && !maxCount.compare_exchange_weak(prev, count))
+            ;
+         BOOST_CHECK_LT(tp.index(), 4);
+         return nullptr;
+      });
+   }
+   waitIdle(tp);
+   BOOST_CHECK_GT(maxCount.load(), 1);
+   BOOST_CHECK_LE(maxCount.load(), 4);
+
+   // Idle threads should exit.
+   const auto t0 = std::chrono::steady_clock::now();
+   while (tp.getThreadCount() > 1 &&
+          std::chrono::steady_clock::now() - t0 < std::chrono::seconds(5))
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   BOOST_CHECK_EQUAL(tp.getThreadCount(), 1);
+
+   // Explicit counts are clamped and still work.
+   tp.setAutoScale(2, 3, std::chrono::milliseconds(1), std::chrono::milliseconds(50));
+   BOOST_CHECK_EQUAL(tp.getThreadCount(), 2);
+   tp.clearAutoScale();
+   tp.setThreadCount(5);
+   tp.synchronize().wait();
+   BOOST_CHECK_EQUAL(tp.getThreadCount(), 5);
+
+   // Threads that poll instead of sleeping exit too.
+   using namespace poolqueue;
+   ThreadPoolT<detail::ConcurrentQueue<Promise>, true, detail::BusySpin> spin(3);
+   spin.setAutoScale(1, 4, std::chrono::milliseconds(1), std::chrono::milliseconds(50));
+   const auto t1 = std::chrono::steady_clock::now();
+   while (spin.getThreadCount() > 1 &&
+          std::chrono::steady_clock::now() - t1 < std::chrono::seconds(5))
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+   BOOST_CHECK_EQUAL(spin.getThreadCount(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(affinity) {
+   const auto cores = poolqueue::ThreadPool::coreCpuSets();
+   const auto sockets = poolqueue::ThreadPool::socketCpuSets();
+#ifdef __linux__
+   BOOST_REQUIRE(!cores.empty());
+   BOOST_REQUIRE(!sockets.empty());
+   BOOST_CHECK_LE(sockets.size(), cores.size());
+#endif
+
+   // Every thread is pinned to its set.
+   poolqueue::ThreadPool tp(4, cores);
+   std::mutex mutex;
+   for (int i = 0; i < 64; ++i) {
+      tp.post([&]() {
+#ifdef __linux__
+         const auto& cpus = cores[tp.index() % cores.size()];
+         const int cpu = sched_getcpu();
+         std::lock_guard<std::mutex> lock(mutex);
+         BOOST_CHECK(std::find(cpus.begin(), cpus.end(), cpu) != cpus.end());
+#endif
+         return nullptr;
+      });
+   }
+   tp.synchronize().wait();
+}
+
 BOOST_AUTO_TEST_CASE(stress) {
    poolqueue::ThreadPool tp;
 
@@ -250,11 +1390,30 @@ BOOST_AUTO_TEST_CASE(performance) {
       }
       tp.synchronize().wait();
       auto endTime = std::chrono::steady_clock::now();
-
       elapsed = std::chrono::duration_cast<decltype(elapsed)>(endTime - bgnTime);
-      std::cout << boost::format("%12d functions in %.6f seconds\n")
+
+      // Repeat with a single batch.
+      bgnTime = std::chrono::steady_clock::now();
+      tp.postN(n, [](size_t) {
+         return nullptr;
+      });
+      tp.synchronize().wait();
+      endTime = std::chrono::steady_clock::now();
+      auto batchElapsed = std::chrono::duration_cast<decltype(elapsed)>(endTime - bgnTime);
+
+      // Repeat without Promises.
+      bgnTime = std::chrono::steady_clock::now();
+      for (size_t i = 0; i < n; ++i)
+         tp.execute([]() {});
+      tp.synchronize().wait();
+      endTime = std::chrono::steady_clock::now();
+      auto executeElapsed = std::chrono::duration_cast<decltype(elapsed)>(endTime - bgnTime);
+
+      std::cout << boost::format("%12d functions in %.6f seconds (postN %.6f seconds, execute %.6f seconds)\n")
          % n
-         % static_cast<double>(elapsed.count()/1000000.0);
+         % static_cast<double>(elapsed.count()/1000000.0)
+         % static_cast<double>(batchElapsed.count()/1000000.0)
+         % static_cast<double>(executeElapsed.count()/1000000.0);
 
       n *= 2;
    } while (elapsed < std::chrono::seconds(1));